@@ -20,7 +20,6 @@ parseCommandLineOptions = do
   p' <- maybe (return stdout) (fdToHandle . Fd . fromIntegral) p
   e' <- maybe (return stdin)  (fdToHandle . Fd . fromIntegral) e
   let window0 = Rect () 0 0 (realToFrac w) (realToFrac h)
-  hSetEncoding e' utf8
   hSetEncoding p' utf8
   hSetBuffering p' LineBuffering
   return (p', e', window0)
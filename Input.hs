@@ -10,6 +10,15 @@ import Data.Ratio
 import Data.Map (Map)
 import qualified Data.Map as M
 import Data.Char
+import Data.Bits
+import Data.Int
+import Data.Word
+import Data.Monoid
+import qualified Data.ByteString as B
+import Data.ByteString (ByteString)
+import qualified Data.Text as T
+import Data.Text.Encoding (decodeUtf8With)
+import Data.Text.Encoding.Error (lenientDecode)
 import Control.Concurrent
 import Control.Concurrent.STM
 
@@ -33,6 +42,8 @@ data RawInput =
   MenuSave |
   MenuSaveAs |
   MenuAbout |
+  TextMetrics Int Double Double Double |
+  TraceStamp Word64 |
   Quit
     deriving (Show, Eq, Ord)
 
@@ -94,6 +105,11 @@ menuAboutOnly :: RawInput -> Maybe ()
 menuAboutOnly MenuAbout = Just ()
 menuAboutOnly _ = Nothing
 
+-- id, width, ascent, descent
+textMetricsOnly :: RawInput -> Maybe (Int, Double, Double, Double)
+textMetricsOnly (TextMetrics n w a d) = Just (n, w, a, d)
+textMetricsOnly _ = Nothing
+
 quitOnly :: RawInput -> Maybe ()
 quitOnly Quit = Just ()
 quitOnly _ = Nothing
@@ -140,6 +156,7 @@ character _ _ c = Character c
 resize _ _ w _ h = Resize (fromIntegral w) (fromIntegral h)
 wheel _ _ z = Wheel z
 filePick _ _ s = FilePick s
+textMetrics _ _ n _ w _ a _ d = TextMetrics (fromIntegral n) w a d
 
 button :: Parser MouseButton
 button = (MouseButton . fromIntegral) <$> decimal
@@ -188,19 +205,78 @@ parseInputLine line = quickParse line $ do
     , try $ MenuSaveAs <$ string "save-as"
     , MenuSave <$ string "save"
     , MenuAbout <$ string "about"
+    , textMetrics <$> string "text-metrics" <*> space <*> decimal
+        <*> space <*> float <*> space <*> float <*> space <*> float
     , Quit <$ string "quit" ]
   eof
   return r
 
+-- mouse, wheel and button events arrive as fixed size binary records
+-- starting with recordMark. everything else is a text line for parseInputLine.
+recordMark :: Word8
+recordMark = 0x01
+
+recordSize :: Int
+recordSize = 10
+
+data Decoded =
+  Decoded RawInput ByteString |
+  Unrecognized String ByteString |
+  Incomplete
+
+decodeInput :: ByteString -> Decoded
+decodeInput buf
+  | B.null buf = Incomplete
+  | B.head buf == recordMark = if B.length buf < recordSize
+      then Incomplete
+      else let (rec, rest) = B.splitAt recordSize buf in
+        case decodeRecord rec of
+          Nothing -> Unrecognized (show (B.unpack rec)) rest
+          Just r -> Decoded r rest
+  | otherwise = case B.elemIndex 0x0a buf of
+      Nothing -> Incomplete
+      Just i ->
+        let line = T.unpack (decodeUtf8With lenientDecode (B.take i buf)) in
+        let rest = B.drop (i+1) buf in
+        case parseInputLine line of
+          Nothing -> Unrecognized line rest
+          Just r -> Decoded r rest
+
+decodeRecord :: ByteString -> Maybe RawInput
+decodeRecord rec = case chr (fromIntegral (B.index rec 1)) of
+  'm' -> Just (Mouse (fromIntegral a / 256) (fromIntegral b / 256))
+  'w' -> Just (Wheel (fromIntegral a / 65536))
+  'c' -> Just (Click (MouseButton (fromIntegral a)))
+  'r' -> Just (Release (MouseButton (fromIntegral a)))
+  't' -> Just (TraceStamp (word a `shiftL` 32 .|. word b))
+  _ -> Nothing
+  where
+    a = be32 rec 2
+    b = be32 rec 6
+    word x = fromIntegral (fromIntegral x :: Word32)
+
+be32 :: ByteString -> Int -> Int32
+be32 bs i = fromIntegral
+  (byte 0 `shiftL` 24 .|. byte 1 `shiftL` 16 .|. byte 2 `shiftL` 8 .|. byte 3)
+  where
+    byte k = fromIntegral (B.index bs (i+k)) :: Word32
+
 handleEvents :: Handle -> (RawInput -> IO ()) -> IO ()
-handleEvents h eat = forever $ do
-  line <- hGetLine h
-  case parseInputLine line of
-    Nothing -> hPutStrLn stderr ("** CORE unrecognized input " ++ line)
-    Just r -> eat r
+handleEvents h eat = go B.empty where
+  go buf = case decodeInput buf of
+    Decoded r rest -> eat r >> go rest
+    Unrecognized junk rest -> do
+      hPutStrLn stderr ("** CORE unrecognized input " ++ junk)
+      go rest
+    Incomplete -> do
+      more <- B.hGetSome h 4096
+      if B.null more
+        then hPutStrLn stderr "CORE input stream has ended"
+        else go (buf <> more)
 
 newInputWorker :: Handle -> IO (IO RawInput)
 newInputWorker h = do
+  hSetBinaryMode h True
   inCh <- newTChanIO
   forkIO (handleEvents h (atomically . writeTChan inCh))
   return (atomically (readTChan inCh))
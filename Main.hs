@@ -4,6 +4,7 @@ module Main where
 import Control.Applicative
 import Data.Monoid
 import Data.List
+import Data.IORef
 import System.Exit
 
 import Debug.Trace
@@ -16,6 +17,7 @@ import Util
 import Config
 import Input
 import Sound
+import Trace
 import Chart
 import Rect
 import Piano
@@ -31,12 +33,24 @@ main = do
   putStrLn "CORE Hello World"
   paint <- newPaintWorker paintOutH
   (soundA, _, _) <- newSoundController
-  play <- newPlayer soundA
-  getIn <- newInputWorker eventInH
+  tracer <- newTracer
+  play <- newPlayer soundA (takeTrace tracer)
+  -- notes from one step go to the player as one batch, sent before the next
+  -- input is taken or when a later step makes a sound
+  pending <- newIORef Nothing
+  let flushSound = readIORef pending >>= mapM_ (\(_, es) -> do
+        writeIORef pending Nothing
+        play (map (0,) (reverse es)))
+  getIn <- (flushSound >>) . tracedInput tracer <$> newInputWorker eventInH
   simulate (program (0,0) window0) getIn $ \t o -> case o of
-    Sound e -> play e
+    Sound e -> do
+      p <- readIORef pending
+      case p of
+        Just (t', es) | t' == t -> writeIORef pending (Just (t, e:es))
+        _ -> flushSound >> writeIORef pending (Just (t, [e]))
     PaintStuff ps -> paint ps
     Shutdown -> do
+      flushSound
       putStrLn "CORE terminating"
       exitSuccess
 
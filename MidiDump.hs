@@ -15,6 +15,13 @@ import Control.Monad
 import Numeric
 import Data.Functor
 
+-- what goes in a sequence dump. sysex bytes are the ones after the 0xF0,
+-- up to 65535 of them.
+data DumpEvent =
+  DumpVoice MidiVoiceEvent |
+  DumpSysEx [Word8]
+    deriving (Eq, Show)
+
 dumpMidiFile :: String -> String -> MidiFile -> IO ()
 dumpMidiFile n1 n2 smf = do
   let p1 = "/tmp/epichord-XYZW/voicedump-" ++ n1
@@ -26,6 +33,14 @@ dumpMidiFile n1 n2 smf = do
   withFile p1 WriteMode (\h -> mapM_ (B.hPut h) chunks1)
   withFile p2 WriteMode (\h -> mapM_ (B.hPut h) chunks2)
 
+-- same as dumpMidiFile but the voice dump is in the compact format
+dumpMidiFileCompact :: String -> String -> MidiFile -> IO ()
+dumpMidiFileCompact n1 n2 smf = do
+  let p1 = "/tmp/epichord-XYZW/voicedump-" ++ n1
+  let p2 = "/tmp/epichord-XYZW/tempodump-" ++ n2
+  B.writeFile p1 (encodeCompact (sortedVoiceEvents smf))
+  withFile p2 WriteMode (\h -> mapM_ (B.hPut h) (uncollateTempoChanges smf))
+
 showChunk1 :: ByteString -> String
 showChunk1 bs =
   let [b1,b2,b3,b4,b5,b6,b7] = map fromIntegral (B.unpack bs) :: [Int] in
@@ -44,10 +59,15 @@ showChunk2 bs =
     , show (b5 `shiftL` 16 .|. b6 `shiftL` 8  .|. b7) ]
   
 
--- normalize and encode all events, then sort them by time
+-- normalize and encode all events track by track. the sound server puts
+-- them in tick order when it loads them.
 uncollateVoiceEvents :: MidiFile -> [B.ByteString]
 uncollateVoiceEvents (MidiFile _ tracks) =
-  map encodeVoice .
+  map encodeVoice (concatMap (undelta . voiceOnly . untrack) tracks)
+
+-- the compact format stores tick deltas, so it is written sorted
+sortedVoiceEvents :: MidiFile -> [(DeltaTime, DumpEvent)]
+sortedVoiceEvents (MidiFile _ tracks) =
   map dropNumber .
   sortBy compareVoice .
   concatMap (number . undelta . voiceOnly . untrack) $ tracks
@@ -55,15 +75,15 @@ uncollateVoiceEvents (MidiFile _ tracks) =
 scope :: Show s => s -> s
 scope x = trace (show x) x
 
-compareVoice :: (DeltaTime, MidiVoiceEvent, Int)
-             -> (DeltaTime, MidiVoiceEvent, Int)
+compareVoice :: (DeltaTime, DumpEvent, Int)
+             -> (DeltaTime, DumpEvent, Int)
              -> Ordering
 compareVoice (a,b,c) (x,y,z) = (compare a x) <> (compare c z)
 
-number :: [(DeltaTime, MidiVoiceEvent)] -> [(DeltaTime, MidiVoiceEvent, Int)]
+number :: [(DeltaTime, DumpEvent)] -> [(DeltaTime, DumpEvent, Int)]
 number xs = zipWith (\(a,b) c -> (a,b,c)) xs [0..]
 
-dropNumber :: (DeltaTime, MidiVoiceEvent, Int) -> (DeltaTime, MidiVoiceEvent)
+dropNumber :: (DeltaTime, DumpEvent, Int) -> (DeltaTime, DumpEvent)
 dropNumber (a,b,c) = (a,b)
 
 uncollateTempoChanges :: MidiFile -> [B.ByteString]
@@ -81,9 +101,10 @@ undelta xs = undeltar xs 0 where
   undeltar [] _ = []
   undeltar ((dt, ev):xs) t = (t + dt, ev) : undeltar xs (t + dt)
 
-voiceOnly :: [(DeltaTime, MidiEvent)] -> [(DeltaTime, MidiVoiceEvent)]
+voiceOnly :: [(DeltaTime, MidiEvent)] -> [(DeltaTime, DumpEvent)]
 voiceOnly = catMaybes . map (\(t,e) -> case e of
-  VoiceEvent _ x -> Just (t, x)
+  VoiceEvent _ x -> Just (t, DumpVoice x)
+  SysExEvent (SysEx _ bytes) | length bytes <= 0xffff -> Just (t, DumpSysEx bytes)
   _ -> Nothing)
 
 tempoOnly :: [(DeltaTime, MidiEvent)] -> [(DeltaTime, Word32)]
@@ -91,9 +112,15 @@ tempoOnly = catMaybes . map (\(t,e) -> case e of
   MetaEvent (SetTempo w) -> Just (t, w)
   _ -> Nothing)
 
--- turn a message into 4+3 bytes
-encodeVoice :: (DeltaTime, MidiVoiceEvent) -> B.ByteString
-encodeVoice (t, ev) = encode32 (fromIntegral t) <> encodeVoiceEvent ev
+-- turn a message into 4+3 bytes, a sysex is 4 + 0xF0 + 2 byte length and
+-- the bytes
+encodeVoice :: (DeltaTime, DumpEvent) -> B.ByteString
+encodeVoice (t, DumpVoice ev) = encode32 (fromIntegral t) <> encodeVoiceEvent ev
+encodeVoice (t, DumpSysEx bytes) =
+  encode32 (fromIntegral t) <>
+  B.pack [0xF0, fromIntegral (n `shiftR` 8), fromIntegral (n .&. 0xff)] <>
+  B.pack bytes
+    where n = length bytes
   
 -- write an encoder for the timestamp.
 -- write an encoder for a voice message.
@@ -123,6 +150,62 @@ encodeVoiceEvent e = case e of
     , fromIntegral ((bb .&. 0xff00) `shiftR` 8)
     , fromIntegral (bb .&. 0xff) ]
 
+-- compact voice dump. a 16 byte header ("EPCZ", event count, block count,
+-- events per block), an index of (first tick, byte offset) per block, then
+-- the blocks. an event is a varint of delta tick * 2 + 1 if the status byte
+-- follows, the status byte unless it's the same as the last one, then the
+-- data bytes. a sysex has status 0xF0, a varint length and the bytes after
+-- the 0xF0. each block starts over from its first tick with no status.
+encodeCompact :: [(DeltaTime, DumpEvent)] -> B.ByteString
+encodeCompact evs = B.concat ([header] ++ index ++ bodies) where
+  blocks = blocksOf compactBlockSize evs
+  bodies = map encodeBlock blocks
+  offsets = scanl (+) 0 (map B.length bodies)
+  header = B.concat
+    [ B.pack [0x45, 0x50, 0x43, 0x5a]
+    , encode32 (fromIntegral (length evs))
+    , encode32 (fromIntegral (length blocks))
+    , encode32 (fromIntegral compactBlockSize) ]
+  index = zipWith blockEntry blocks offsets
+  blockEntry blk off = encode32 (blockStart blk) <> encode32 (fromIntegral off)
+  blockStart ((t, _):_) = fromIntegral t
+  blockStart [] = 0
+
+compactBlockSize :: Int
+compactBlockSize = 256
+
+blocksOf :: Int -> [a] -> [[a]]
+blocksOf _ [] = []
+blocksOf n xs = let (a, b) = splitAt n xs in a : blocksOf n b
+
+encodeBlock :: [(DeltaTime, DumpEvent)] -> B.ByteString
+encodeBlock [] = B.empty
+encodeBlock evs@((t0, _):_) = B.concat (go t0 Nothing evs) where
+  go _ _ [] = []
+  go prev running ((t, ev):more) =
+    let (status, body) = compactBody ev
+        fresh = running /= Just status
+        delta = fromIntegral (t - prev) * 2 + (if fresh then 1 else 0) in
+    encodeVarint delta <>
+    (if fresh then B.singleton status else B.empty) <>
+    body :
+    go t (Just status) more
+
+compactBody :: DumpEvent -> (Word8, B.ByteString)
+compactBody (DumpSysEx bytes) =
+  (0xF0, encodeVarint (fromIntegral (length bytes)) <> B.pack bytes)
+compactBody (DumpVoice ev) =
+  let (status:dat) = B.unpack (encodeVoiceEvent ev)
+      dataSize = if status .&. 0xe0 == 0xc0 then 1 else 2 in
+  (status, B.pack (take dataSize dat))
+
+-- little endian base 128
+encodeVarint :: Word32 -> B.ByteString
+encodeVarint n
+  | n < 0x80 = B.singleton (fromIntegral n)
+  | otherwise =
+      B.cons (fromIntegral (n .&. 0x7f) .|. 0x80) (encodeVarint (n `shiftR` 7))
+
 encodeTempo :: (DeltaTime, Word32) -> B.ByteString
 encodeTempo (t, w) = encode32 (fromIntegral t) <> encodeTempoEvent w
 
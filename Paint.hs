@@ -34,6 +34,8 @@ data Paint =
   Upload Int Pixmap |
   PutImage R2 Int |
   Label R2 Text |
+  ColorLabel R2 Color Text |
+  QueryText Int Text |
   FilePicker |
   Copy Text |
   Clip Frame |
@@ -48,6 +50,8 @@ showPaint p = case p of
   Upload n pix -> "?"
   PutImage x n -> "?"
   Label x txt -> "?"
+  ColorLabel x c txt -> "?"
+  QueryText n txt -> "QueryText " ++ show n ++ " " ++ show txt
   FilePicker -> "FilePicker"
   Copy txt -> "Copy " ++ show txt
   SetCursor c -> "SetCursor " ++ show c
@@ -155,6 +159,10 @@ encodePaintCommand p = mconcat (intersperse space words) where
     PutImage xy n -> ["image" , encodeR2 xy, intDec n]
     Label xy s ->
       ["label", encodeR2 xy, (byteString . encodeUtf8 . T.map sp2nl) s]
+    ColorLabel xy rgb s ->
+      ["text", encodeR2 xy, encodeRGB rgb, (byteString . encodeUtf8 . T.map sp2nl) s]
+    QueryText n s ->
+      ["text-query", intDec n, (byteString . encodeUtf8 . T.map sp2nl) s]
     FilePicker -> ["file-picker"]
     Copy s -> ["copy", byteString (encodeUtf8 s)]
     SetCursor c -> ["cursor"]
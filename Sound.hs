@@ -1,12 +1,38 @@
+{-# LANGUAGE ForeignFunctionInterface #-}
 module Sound where
 
 import System.IO
 import System.Process
 import System.Exit
+import System.Posix.SharedMem
+import System.Posix.Files (setFdSize)
+import System.Posix.IO (closeFd)
+import System.Posix.Types (Fd(..))
+import System.Posix.Process (getProcessID)
+import Foreign.Ptr
+import Foreign.Marshal.Alloc (allocaBytes)
+import Foreign.Storable
+import Foreign.C.Types
+import Data.Word
+import Data.Char (isHexDigit)
+import Numeric (readHex)
+import Control.Applicative
 import Control.Concurrent
+import Control.Exception
+import GHC.Clock (getMonotonicTime)
+import Control.Monad (when)
+import Data.List (partition)
 
 data PlayerCommand =
   Load String String |
+  LoadLayer Int String |
+  ClearLayer Int |
+  LayerOffset Int Int |
+  LayerLoop Int Int |
+  MuteLayer Int |
+  UnmuteLayer Int |
+  Tempo String |
+  TempoScale Double |
   Play |
   Stop |
   Seek Int Int Int |
@@ -16,38 +42,184 @@ data PlayerCommand =
   TicksPerBeat Int |
   EnableCapture |
   DisableCapture |
+  ClearCapture |
   Execute Int Int Int Int |
+  Schedule [(Int, Int, Int, Int, Int)] |
+  Express [(Int, Int, Int, Int)] |
+  Lookahead Int |
+  AdaptLookahead Int Int |
   CutAll |
+  Trace Int [Word64] |
+  TraceDump String |
+  TraceHistogram String |
+  TraceClear |
   Exit |
   Crash
     deriving (Eq, Show)
 
-data Blub = Blub deriving (Show)
+-- an overdubbed event as reported by CAPTURE
+data CapturedEvent = CapturedEvent
+  { ceTick :: Int
+  , ceStatus :: Int
+  , ceArg1 :: Int
+  , ceArg2 :: Int }
+    deriving (Eq, Show)
+
+-- transport state as published by the sound server each frame
+data Playhead = Playhead
+  { phPlaying :: Bool
+  , phSongNs :: Word64
+  , phBeat :: Double
+  , phUspq :: Int
+  , phTicksPerBeat :: Int }
+    deriving (Show)
+
+playheadSize :: Int
+playheadSize = 4096
+
+foreign import ccall unsafe "mmap"
+  c_mmap :: Ptr () -> CSize -> CInt -> CInt -> CInt -> CLong -> IO (Ptr ())
+
+-- the page is created here, before the sound server is spawned, so it is
+-- always there to read
+mapPlayhead :: String -> IO (Ptr ())
+mapPlayhead name = do
+  fd@(Fd cfd) <- shmOpen name (ShmOpenFlags True True False True) 0o600
+  setFdSize fd (fromIntegral playheadSize)
+  ptr <- c_mmap nullPtr (fromIntegral playheadSize) 1 1 cfd 0
+  closeFd fd
+  if ptr == nullPtr `plusPtr` (-1)
+    then do
+      hPutStrLn stderr ("CORE failed to map playhead page " ++ name)
+      exitFailure
+    else return ptr
+
+foreign import ccall unsafe "readPlayheadPage"
+  c_readPlayheadPage :: Ptr () -> Ptr () -> IO ()
+
+-- seqlock read in playhead.c, which retries while the server is in the
+-- middle of an update. plain peeks aren't enough, the cpu may reorder them.
+readPlayhead :: Ptr () -> IO Playhead
+readPlayhead page = allocaBytes 32 $ \p -> do
+  c_readPlayheadPage page p
+  playing <- peekByteOff p 4 :: IO Word32
+  ns <- peekByteOff p 8
+  beat <- peekByteOff p 16
+  uspq <- peekByteOff p 24 :: IO Word32
+  tpb <- peekByteOff p 28 :: IO Word32
+  return $
+    Playhead (playing /= 0) ns beat (fromIntegral uspq) (fromIntegral tpb)
   
-newSoundController :: IO (PlayerCommand -> IO (), IO Double, IO [Blub])
+type SoundProcess = (Handle, Handle, ProcessHandle)
+
+-- the sound server names its shared memory segments after shmBase
+newSoundController :: IO (PlayerCommand -> IO (), IO Playhead, IO [CapturedEvent])
 newSoundController = do
-  (Just out, Just inn, Nothing, _) <- createProcess (proc "./sound" [])
-    { std_in  = CreatePipe
-    , std_out = CreatePipe }
-  lock <- newMVar ()
+  pid <- getProcessID
+  let shmBase = "/epichord-" ++ show pid
+  page <- mapPlayhead (shmBase ++ "-ph")
+  sp <- spawnSound shmBase False >>= newMVar
+  _ <- forkIO (superviseSound shmBase sp)
   return
-    ( \cmd -> withMVar lock $ \_ -> do
+    ( \cmd -> withMVar sp $ \(out, _, _) -> tolerateDeadServer () $ do
         hPutStrLn out (encodeCommand cmd)
         hFlush out
-    , withMVar lock $ \_ -> do
-        hPutStrLn out "tell"
+    , readPlayhead page
+    , withMVar sp $ \(out, inn, _) -> tolerateDeadServer [] $ do
+        hPutStrLn out "capture"
         hFlush out
-        line <- hGetLine inn
-        case reads line of
-          [(beat, "")] -> return beat
-          _ -> do
-            hPutStrLn stderr (concat ["CORE bad tell response (", line, ")"])
-            exitFailure
-    , return [Blub, Blub, Blub] )
+        readCaptured inn )
+
+-- a resumed server takes over the state left in shared memory by the last
+spawnSound :: String -> Bool -> IO SoundProcess
+spawnSound shmBase resume = do
+  let args = if resume then ["--resume", shmBase] else [shmBase]
+  (Just out, Just inn, Nothing, ph) <- createProcess (proc "./sound" args)
+    { std_in  = CreatePipe
+    , std_out = CreatePipe }
+  return (out, inn, ph)
+
+-- if the sound server dies, start another. it takes over the loaded
+-- sequences and transport state from shared memory and carries on playing.
+-- a resumed server that dies within restartWindow is replaced by a fresh one
+-- in case the saved state is what kills it. restarts back off, and after
+-- restartLimit quick deaths in a row the supervisor gives up.
+superviseSound :: String -> MVar SoundProcess -> IO ()
+superviseSound shmBase sp = go 0 False where
+  go quickDeaths resumed = do
+    (_, _, ph) <- readMVar sp
+    t0 <- getMonotonicTime
+    code <- waitForProcess ph
+    t1 <- getMonotonicTime
+    case code of
+      ExitSuccess -> return ()
+      ExitFailure n -> do
+        let quick = t1 - t0 < restartWindow
+        let deaths = if quick then quickDeaths + 1 else 0
+        let resume = not (quick && resumed)
+        if deaths > restartLimit
+          then hPutStrLn stderr
+            ("CORE sound server died (" ++ show n ++ ") " ++
+             show deaths ++ " times in a row, giving up")
+          else do
+            hPutStrLn stderr $ concat
+              [ "CORE sound server died (", show n, "), restarting"
+              , if resume then "" else " without its saved state" ]
+            threadDelay (restartDelay deaths)
+            modifyMVar_ sp $ \(out, inn, _) -> do
+              tolerateDeadServer () (hClose out >> hClose inn)
+              spawnSound shmBase resume
+            go deaths resume
+
+-- seconds
+restartWindow :: Double
+restartWindow = 2
+
+restartLimit :: Int
+restartLimit = 5
+
+-- microseconds. the first restart is immediate, then it doubles with each
+-- further quick death
+restartDelay :: Int -> Int
+restartDelay deaths
+  | deaths <= 1 = 0
+  | otherwise = 100000 * 2 ^ (min deaths restartLimit - 2)
+
+-- commands sent while the server is down are lost, the supervisor restarts it
+tolerateDeadServer :: a -> IO a -> IO a
+tolerateDeadServer dflt io = io `catch` \e -> do
+  hPutStrLn stderr ("CORE sound server unreachable " ++ show (e :: IOException))
+  return dflt
+
+readCaptured :: Handle -> IO [CapturedEvent]
+readCaptured h = do
+  line <- hGetLine h
+  if line == "end"
+    then return []
+    else case decodeCaptured line of
+      Just ev -> (ev:) <$> readCaptured h
+      Nothing -> do
+        hPutStrLn stderr (concat ["CORE bad capture line (", line, ")"])
+        exitFailure
+
+decodeCaptured :: String -> Maybe CapturedEvent
+decodeCaptured line
+  | length line /= 14 || not (all isHexDigit line) = Nothing
+  | otherwise = Just (CapturedEvent (hex 0 8) (hex 8 2) (hex 10 2) (hex 12 2))
+  where
+    hex i n = fst . head . readHex . take n . drop i $ line
 
 encodeCommand :: PlayerCommand -> String
 encodeCommand c = case c of
   Load p1 p2 -> unwords ["load", p1, p2]
+  LoadLayer n p -> unwords ["load-layer", show n, p]
+  ClearLayer n -> unwords ["clear-layer", show n]
+  LayerOffset n t -> unwords ["layer-offset", show n, show t]
+  LayerLoop n t -> unwords ["layer-loop", show n, show t]
+  MuteLayer n -> unwords ["mute-layer", show n]
+  UnmuteLayer n -> unwords ["unmute-layer", show n]
+  Tempo p -> unwords ["tempo", p]
+  TempoScale x -> unwords ["tempo-scale", show x]
   Play -> "play"
   Stop -> "stop"
   Seek whole num denom ->
@@ -58,19 +230,35 @@ encodeCommand c = case c of
   TicksPerBeat n -> unwords ["ticks-per-beat", show n]
   EnableCapture -> "enable-capture"
   DisableCapture -> "disable-capture"
+  ClearCapture -> "clear-capture"
   Execute ty ch arg1 arg2 ->
     unwords ["execute", show ty, show ch, show arg1, show arg2]
+  Schedule evs -> unwords ("schedule" : concatMap fields evs) where
+    fields (delay, ty, ch, arg1, arg2) = map show [delay, ty, ch, arg1, arg2]
+  Express evs -> unwords ("express" : concatMap fields evs) where
+    fields (ty, ch, arg1, arg2) = map show [ty, ch, arg1, arg2]
+  Lookahead us -> unwords ["lookahead", show us]
+  AdaptLookahead us0 us1 -> unwords ["adapt-lookahead", show us0, show us1]
   CutAll -> "cut-all"
+  Trace n stamps -> unwords ("trace" : show n : map show stamps)
+  TraceDump p -> unwords ["trace-dump", p]
+  TraceHistogram p -> unwords ["trace-histogram", p]
+  TraceClear -> "trace-clear"
   Exit -> "exit"
   Crash -> "crash"
 
-newPlayer :: (PlayerCommand -> IO ()) -> IO (Either Int Int -> IO ())
-newPlayer dispatch = return $ \eith -> do
-  _ <- forkIO $ do
-    case eith of
-      Right note -> dispatch (Execute 9 0 note 127)
-      Left note -> dispatch (Execute 8 0 note 127)
-    threadDelay 1000000
-    --dispatch (Execute 8 0 note 127)
-  return ()
-
+-- play notes now or after a delay in microseconds. notes for now go out
+-- on the express path, the rest are one write and the sound server keeps the
+-- spacing between them. a pending latency trace is sent ahead of the batch.
+newPlayer :: (PlayerCommand -> IO ())
+          -> IO (Maybe (Int, [Word64]))
+          -> IO ([(Int, Either Int Int)] -> IO ())
+newPlayer dispatch takeTrace = return $ \batch -> do
+  let (now, later) = partition ((== 0) . fst) batch
+  when (not (null batch)) $ takeTrace >>= mapM_ (\(n, ts) -> dispatch (Trace n ts))
+  when (not (null now)) $ dispatch (Express (map (voice . snd) now))
+  when (not (null later)) $ dispatch (Schedule (map liveNote later))
+  where
+    liveNote (delay, note) = let (ty, ch, a1, a2) = voice note in (delay, ty, ch, a1, a2)
+    voice (Right note) = (9, 0, note, 127)
+    voice (Left note) = (8, 0, note, 127)
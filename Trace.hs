@@ -0,0 +1,52 @@
+{-# LANGUAGE ForeignFunctionInterface #-}
+module Trace where
+
+import Control.Applicative
+import Data.IORef
+import Data.Word
+
+import Input
+
+-- stamps are taken from the same clock video and the sound server use, so
+-- the hops of one trace can be compared across the three processes
+foreign import ccall unsafe "mach_absolute_time" hostTime :: IO Word64
+
+-- a stamp from video arrives just before the event it belongs to. the trace
+-- goes to the player if that event makes a sound before the next input.
+data TraceState =
+  Untraced |
+  Armed Word64 Word64 |
+  Live Word64 Word64
+
+data Tracer = Tracer (IORef Int) (IORef TraceState)
+
+newTracer :: IO Tracer
+newTracer = Tracer <$> newIORef 0 <*> newIORef Untraced
+
+-- wrap the input source. stamps are taken out here.
+tracedInput :: Tracer -> IO RawInput -> IO RawInput
+tracedInput (Tracer _ st) getIn = go where
+  go = do
+    r <- getIn
+    case r of
+      TraceStamp t0 -> do
+        t1 <- hostTime
+        writeIORef st (Armed t0 t1)
+        go
+      _ -> do
+        modifyIORef st advance
+        return r
+  advance (Armed t0 t1) = Live t0 t1
+  advance _ = Untraced
+
+-- the id and the video, core in and core out stamps of the current trace
+takeTrace :: Tracer -> IO (Maybe (Int, [Word64]))
+takeTrace (Tracer counter st) = do
+  s <- readIORef st
+  case s of
+    Live t0 t1 -> do
+      writeIORef st Untraced
+      n <- atomicModifyIORef' counter (\n -> (n+1, n))
+      t2 <- hostTime
+      return (Just (n, [t0, t1, t2]))
+    _ -> return Nothing
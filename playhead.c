@@ -0,0 +1,27 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <sched.h>
+
+#define PLAYHEAD_FIELDS_SIZE 32
+
+// core side of the playhead seqlock, see publishPlayhead in sound.c. copies
+// the fields of a consistent update into out. the acquire load and fence
+// keep the payload reads between the two sequence reads on weakly ordered
+// cpus like arm64, where plain loads may be reordered.
+void readPlayheadPage(const void* page, void* out){
+  const _Atomic uint32_t* sequence = page;
+  uint32_t s0;
+  uint32_t s1;
+  for(;;){
+    s0 = atomic_load_explicit(sequence, memory_order_acquire);
+    if(s0 & 1){ // update in progress
+      sched_yield();
+      continue;
+    }
+    memcpy(out, page, PLAYHEAD_FIELDS_SIZE);
+    atomic_thread_fence(memory_order_acquire);
+    s1 = atomic_load_explicit(sequence, memory_order_relaxed);
+    if(s0 == s1) return;
+  }
+}
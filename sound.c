@@ -7,19 +7,49 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <mach/mach.h>
 #include <mach/mach_time.h>
 
-#define FRAME_SIZE_NS 20000000
+#define DEFAULT_FRAME_NS 20000000
+#define MIN_FRAME_NS 1000000
+#define MAX_FRAME_NS 100000000
 #define PLAYING_MAX 1024
 #define INBUF_SIZE 1024
 #define PACKET_LIST_SIZE 4096
 #define DEFAULT_USPQ 500000 // 120 bpm
 #define GARBAGE_SIZE 32
+#define SHM_BASE_NAME "/epichord"
+#define SHM_NAME_SIZE 32 // macOS allows 31 characters
+#define PLAYHEAD_SHM_SIZE 4096
+#define STATE_SHM_SIZE 4096
+#define STATE_MAGIC 0x45504348 // "EPCH"
+#define STATE_VERSION 2
+#define TAKE_SIZE 65536
+#define TAKE_RUNS 64
+#define TAKE_MAX 8
+#define LAYER_MAX 16
+#define LAYER_PIECES 8
+#define OWNER_LIVE LAYER_MAX // notes not played from a layer
+#define CURSOR_MAX (LAYER_MAX*LAYER_PIECES + TAKE_MAX*TAKE_RUNS)
+#define LOOP_MIN_NS 1000000
+#define LIVE_MAX 1024
+#define COMPACT_MAGIC 0x4550435a // "EPCZ"
+#define COMPACT_HEADER_SIZE 16
+#define SYSEX_MAX 65536 // per sequence
+#define SYSEX_RING 65536
+#define SYSEX_QUEUE 64
+#define SYSEX_CHUNK_MAX 512
+#define SYSEX_CHUNK_MIN 32
+#define MIDI_WIRE_BYTES_PER_S 3125
+#define TRACE_RING 4096
+#define TRACE_PENDING 64
+#define TRACE_BUCKETS 24 // powers of 2 microseconds
 
 struct sequencerEvent {
   uint32_t tick;
-  uint64_t atNs;
   uint8_t typeChan;
   uint8_t arg1;
   uint8_t arg2;
@@ -31,36 +61,205 @@ struct tempoChange {
   uint32_t uspq; // microseconds per quarter note
 };
 
+// events only carry ticks. song time is mapped to ticks through the current
+// tempo map at dispatch, so the tempo map can be swapped while playing.
+struct tempoMap {
+  uint32_t ticksPerBeat;
+  int count;
+  struct tempoChange* changes;
+};
+
+// variable length events (sysex) live out of line in the sequence's arena.
+// an 0xf0 event holds the index of its ref in arg1 (high) and arg2 (low).
+// refs are at the start of the arena, offsets count from the arena start
+// and point at the bytes after the 0xf0.
+struct sysexRef {
+  uint32_t offset;
+  uint32_t length;
+};
+
 struct sequence {
   int eventCount;
-  int tempoChangeCount;
   struct sequencerEvent* events;
-  struct tempoChange* tempoChanges;
+  int sysexCount;
+  uint32_t arenaSize;
+  uint8_t* arena;
+};
+
+struct arenaBuilder {
+  int count;
+  int refMax;
+  struct sysexRef* refs;
+  uint32_t size;
+  uint32_t max;
+  uint8_t* bytes;
+};
+
+// a sysex message on its way out, length bytes at start in the sysex ring
+struct sysexOut {
+  uint64_t when;
+  uint32_t start;
+  uint32_t length;
+};
+
+// a sequence placed in the song at an offset in ticks. with a loop length the
+// first loopTicks of it repeat from the offset on. layer 0 is what LOAD
+// replaces, the others are loaded independently.
+struct layer {
+  struct sequence* seq;
+  int64_t offset;
+  uint32_t loopTicks;
+  int muted;
+};
+
+// an overdub take. the capture thread appends, the dispatch thread only plays
+// events below the visible mark, which moves up when the loop wraps. a run is
+// a stretch of nondecreasing ticks, a new one starts each time the ticks go
+// backwards (one per loop pass).
+struct take {
+  struct sequencerEvent events[TAKE_SIZE];
+  int runStart[TAKE_RUNS];
+  volatile int runCount;
+  volatile int count;
+  volatile int visible;
+  uint32_t lastTick;
+  int reported;
+  int dropped;
+};
+
+// loop bounds in song time and the main sequence events inside them. the
+// dispatch thread works this out again whenever the sequence, the tempo map
+// or the loop points change, so a wrap is only a reset to first.
+struct loopRange {
+  uint64_t startNs;
+  uint64_t endNs;
+  int first;
+  int last;
+};
+
+// a range of sorted events still to be merged into the frame. base is added
+// to the event ticks to get song ticks.
+struct cursor {
+  struct sequencerEvent* at;
+  struct sequencerEvent* end;
+  int64_t base;
+  struct sequence* seq; // for its sysex arena, NULL for takes
+  int owner; // layer or OWNER_LIVE
+};
+
+// which song time the frame being dispatched starts at. seqlock like the
+// playhead page, written by the dispatch thread, read by the capture thread.
+struct songClock {
+  volatile uint32_t sequence;
+  uint64_t absNs;
+  uint64_t songNs;
+  double scale;
+};
+
+// transport state published for the core to read without a TELL. seqlock,
+// the sequence number is odd while the single writer is updating.
+struct playheadPage {
+  volatile uint32_t sequence;
+  uint32_t playing;
+  uint64_t songNs;
+  double beat;
+  uint32_t uspq;
+  uint32_t ticksPerBeat;
+};
+
+struct savedLayer {
+  int64_t offset;
+  uint32_t loopTicks;
+  uint32_t muted;
+  uint32_t present;
+};
+
+// what a restarted server needs to carry on where the last one left off.
+// events and tempo changes are kept in their own segments, copied at load.
+struct savedState {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t playing;
+  uint32_t ticksPerBeat;
+  uint64_t songNs;
+  double tempoScale;
+  uint32_t loopFlag;
+  uint32_t loopInitialized;
+  double loopStartBeat;
+  double loopEndBeat;
+  uint64_t restartLatencyNs;
+  uint64_t frameNs;
+  uint32_t adaptFlag;
+  uint64_t adaptMinNs;
+  uint64_t adaptMaxNs;
+  struct savedLayer layers[LAYER_MAX];
+};
+
+// header of a layer or tempo segment, followed by the raw structs
+struct segmentHeader {
+  uint32_t count;
+  uint32_t aux; // ticks per beat of a tempo map, sysex count of an arena
+};
+
+// a live event scheduled by SCHEDULE or EXECUTE, at host time when.
+// serial keeps events with the same time in the order they were sent.
+// EXPRESS events are sent by the main thread and only noted here.
+struct liveEvent {
+  uint64_t when;
+  uint32_t serial;
+  uint8_t midi[3];
+  uint8_t sent;
+  uint8_t trace; // pending trace slot + 1, 0 for none
+};
+
+// stamps of one traced input event, host time at each hop
+enum {
+  HOP_VIDEO,    // video wrote the event
+  HOP_CORE_IN,  // core took it off the input queue
+  HOP_CORE_OUT, // core handed the resulting notes to the player
+  HOP_SOUND_IN, // the note command arrived here
+  HOP_MIDI_OUT, // the first note went out
+  TRACE_STAMPS
+};
+
+struct trace {
+  uint32_t id;
+  volatile uint32_t done; // ring position + 1 once filled in
+  uint64_t stamps[TRACE_STAMPS];
 };
 
 struct playingNote {
   unsigned char playing : 1;
   unsigned char channel : 4;
   unsigned char note : 7;
+  unsigned char owner : 5; // layer or OWNER_LIVE
 };
 
 MIDIClientRef client;
 MIDIEndpointRef inputPort;
 MIDIEndpointRef outputPort;
 pthread_t dispatchThread;
+pthread_t liveThread;
 
 int playFlag = 0;
+volatile uint64_t frameNs = DEFAULT_FRAME_NS;
+int adaptFlag = 0;
+uint64_t adaptMinNs;
+uint64_t adaptMaxNs;
+uint64_t wakeLatePeakNs = 0;
 uint64_t absolutePlayHeadNs;
 uint64_t absoluteLeadingEdgeNs;
-uint64_t absoluteSongStartNs;
 uint64_t songNs = 0;
+double tempoScale = 1.0;
 
 int onlineSeekFlag = 0;
 uint64_t onlineSeekTargetNs;
 int cutAllFlag = 0;
+volatile uint32_t cutLayerMask = 0;
 
 int loopFlag = 0;
 int loopInitialized = 0;
+volatile int loopGeneration = 0;
 uint64_t loopStartNs;
 uint64_t loopEndNs;
 double loopStartBeat;
@@ -68,12 +267,58 @@ double loopEndBeat;
 
 uint32_t ticksPerBeat = 384;
 
-struct sequence* currentSequence = NULL;
+struct layer layers[LAYER_MAX];
+int layerCount = 1;
+struct tempoMap* currentTempoMap = NULL;
+struct playheadPage* playhead = NULL;
+struct savedState* saved = NULL;
+char* shmBase = SHM_BASE_NAME;
+uint64_t startedNs;
+int resumePending = 0;
 struct sequence* garbage[GARBAGE_SIZE];
+struct take* takes[TAKE_MAX];
+volatile int takeCount = 0;
+struct take* recordingTake = NULL;
+int captureFlag = 0;
+volatile int captureBusy = 0;
+struct songClock frameClock;
+struct tempoMap* tempoGarbage[GARBAGE_SIZE];
+struct liveEvent liveInbox[LIVE_MAX];
+volatile uint32_t liveInboxWrite = 0;
+volatile uint32_t liveInboxRead = 0;
+uint32_t liveSerial = 0;
+struct liveEvent livePending[LIVE_MAX];
+int livePendingCount = 0;
+volatile int liveFlag = 0;
+uint8_t sysexRing[SYSEX_RING];
+uint32_t sysexRingWrite = 0;
+uint32_t sysexRingRead = 0;
+struct sysexOut sysexQueue[SYSEX_QUEUE];
+int sysexHead = 0;
+int sysexPending = 0;
+int sysexStarted = 0;
+volatile int sysexStreaming = 0;
+volatile uint64_t sysexBusyUntilNs = 0;
+int64_t stallTick = -1;
+int stallSkip = 0;
+struct trace armedTrace;
+int traceArmed = 0;
+struct trace tracePending[TRACE_PENDING];
+uint32_t tracePendingNext = 0;
+struct trace traceRing[TRACE_RING];
+volatile uint32_t traceWrite = 0;
+uint32_t traceCleared = 0;
+struct trace traceCopy[TRACE_RING];
 
 pthread_mutex_t garbageMutex;
 pthread_cond_t garbageSignal;
 
+void freeSequence(struct sequence* seq){
+  free(seq->events);
+  free(seq->arena);
+  free(seq);
+}
+
 void trashSequence(struct sequence* seq){
   int i;
   for(i=0; i<GARBAGE_SIZE; i++){
@@ -87,28 +332,87 @@ void trashSequence(struct sequence* seq){
   exit(-1);
 }
 
+void trashTempoMap(struct tempoMap* tm){
+  int i;
+  for(i=0; i<GARBAGE_SIZE; i++){
+    if(tempoGarbage[i] == NULL){
+      tempoGarbage[i] = tm;
+      return;
+    }
+  }
+
+  fprintf(stderr, "** SOUND tempo garbage has piled up\n");
+  exit(-1);
+}
+
 void emptyTrash(){
   pthread_cond_signal(&garbageSignal);
 }
 
+// index of the tempo change in effect, -1 means the default tempo. the
+// changes are sorted, these run per event so they bisect.
+int tempoIndexAtTick(struct tempoMap* tm, double tick){
+  int lo = 0;
+  int hi = tm->count;
+  int mid;
+  while(lo < hi){ // first change after tick
+    mid = lo + (hi - lo) / 2;
+    if(tm->changes[mid].tick <= tick) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo - 1;
+}
+
+int tempoIndexAtNs(struct tempoMap* tm, uint64_t ns){
+  int lo = 0;
+  int hi = tm->count;
+  int mid;
+  while(lo < hi){
+    mid = lo + (hi - lo) / 2;
+    if(tm->changes[mid].atNs <= ns) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo - 1;
+}
+
+uint64_t tickToNs(struct tempoMap* tm, double tick){
+  int i = tempoIndexAtTick(tm, tick);
+  if(i < 0) return tick*1000.0*DEFAULT_USPQ/tm->ticksPerBeat;
+  return tm->changes[i].atNs +
+    (tick - tm->changes[i].tick)*1000.0*tm->changes[i].uspq/tm->ticksPerBeat;
+}
+
+double nsToTick(struct tempoMap* tm, uint64_t ns){
+  int i = tempoIndexAtNs(tm, ns);
+  if(i < 0) return ns * (double)tm->ticksPerBeat / (1000.0*DEFAULT_USPQ);
+  return tm->changes[i].tick +
+    (ns - tm->changes[i].atNs) * (double)tm->ticksPerBeat /
+    (1000.0*tm->changes[i].uspq);
+}
+
+uint32_t uspqAtNs(struct tempoMap* tm, uint64_t ns){
+  int i = tempoIndexAtNs(tm, ns);
+  return i < 0 ? DEFAULT_USPQ : tm->changes[i].uspq;
+}
+
 uint64_t beatToNs(double beat){
-  struct sequence* seqSnap = currentSequence;
-  struct tempoChange* tempoChanges = seqSnap->tempoChanges;
-  int tempoChangeCount = seqSnap->tempoChangeCount;
-  uint32_t targetTick = beat * ticksPerBeat;
-  uint32_t uspq;
-  uint32_t baseTick;
+  struct tempoMap* tm = currentTempoMap;
+  return tickToNs(tm, beat * tm->ticksPerBeat);
+}
+
+// only touches the tempo changes, never the events
+void computeTempoTimes(struct tempoMap* tm){
   int i;
-  if(tempoChangeCount == 0 || targetTick < tempoChanges[i].tick){
-    uspq = DEFAULT_USPQ;
-    baseTick = 0;
-  }
-  else{
-    for(i=0; i<tempoChangeCount-1 && targetTick > tempoChanges[i].tick; i++);
-    uspq = tempoChanges[i].uspq;
-    baseTick = tempoChanges[i].tick;
+  uint32_t uspq = DEFAULT_USPQ;
+  uint64_t prevNs = 0;
+  uint32_t prevTick = 0;
+  for(i=0; i<tm->count; i++){
+    tm->changes[i].atNs = prevNs +
+      (tm->changes[i].tick - prevTick)*1000.0*uspq/tm->ticksPerBeat;
+    prevTick = tm->changes[i].tick;
+    prevNs = tm->changes[i].atNs;
+    uspq = tm->changes[i].uspq;
   }
-  return (targetTick-baseTick)*1000.0*uspq/ticksPerBeat;
 }
 
 
@@ -118,55 +422,241 @@ void setLoopEndpoints(double loop0, double loop1){
   loopStartNs = beatToNs(loop0);
   loopEndNs = beatToNs(loop1);
   loopInitialized = 1;
+  __sync_synchronize();
+  loopGeneration++;
+  saved->loopStartBeat = loop0;
+  saved->loopEndBeat = loop1;
+  saved->loopInitialized = 1;
+}
+
+// keep the play position on the same tick when the tempo map changes
+void rebaseSong(struct tempoMap* from, struct tempoMap* to){
+  songNs = tickToNs(to, nsToTick(from, songNs));
 }
 
 double getCurrentBeat(){
-  struct sequence* seqSnap = currentSequence;
-  struct tempoChange* tempoChanges = seqSnap->tempoChanges;
-  int tempoChangeCount = seqSnap->tempoChangeCount;
-  uint32_t uspq;
-  uint32_t baseNs;
-  uint64_t songNsSnap = songNs;
-  int i;
-  if(tempoChangeCount == 0 || songNsSnap < tempoChanges[i].atNs){
-    uspq = DEFAULT_USPQ;
-    baseNs = 0;
+  struct tempoMap* tm = currentTempoMap;
+  return nsToTick(tm, songNs) / tm->ticksPerBeat;
+}
+
+// only one thread writes at a time. the dispatch thread while playing,
+// the stdin thread otherwise.
+void publishPlayhead(){
+  struct tempoMap* tm = currentTempoMap;
+  if(playhead == NULL) return;
+  playhead->sequence++;
+  __sync_synchronize();
+  playhead->playing = playFlag;
+  playhead->songNs = songNs;
+  playhead->beat = nsToTick(tm, songNs) / tm->ticksPerBeat;
+  playhead->uspq = uspqAtNs(tm, songNs) / tempoScale;
+  playhead->ticksPerBeat = tm->ticksPerBeat;
+  __sync_synchronize();
+  playhead->sequence++;
+  saved->playing = playFlag;
+  saved->songNs = songNs;
+}
+
+void segmentName(char* name, const char* suffix){
+  snprintf(name, SHM_NAME_SIZE, "%s-%s", shmBase, suffix);
+}
+
+// map a named segment of at least size bytes, creating it if needed
+void* mapShared(const char* name, size_t size){
+  struct stat st;
+  void* page;
+  int fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+  if(fd < 0){
+    fprintf(stderr, "** SOUND failed to open shm %s (%s)\n", name, strerror(errno));
+    exit(-1);
   }
-  else{
-    for(i=0; i<tempoChangeCount-1 && songNsSnap > tempoChanges[i].atNs; i++);
-    uspq = tempoChanges[i].uspq;
-    baseNs = tempoChanges[i].atNs;
+  if(fstat(fd, &st) < 0){
+    fprintf(stderr, "** SOUND failed to stat shm %s (%s)\n", name, strerror(errno));
+    exit(-1);
+  }
+  if(st.st_size < size && ftruncate(fd, size) < 0){
+    fprintf(stderr, "** SOUND failed to size shm %s (%s)\n", name, strerror(errno));
+    exit(-1);
+  }
+  page = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(page == MAP_FAILED){
+    fprintf(stderr, "** SOUND failed to map shm %s (%s)\n", name, strerror(errno));
+    exit(-1);
   }
-  return (songNsSnap - baseNs)/(1000.0 * uspq);
+  close(fd);
+  return page;
 }
 
-void executeSeek(int number, int numerator, int denominator){
-  struct sequence* seqSnap = currentSequence;
-  double beat = number + (double)numerator / denominator;
-  uint32_t targetTick = beat * ticksPerBeat;
-  uint64_t targetNs;
-  uint32_t uspq;
-  uint32_t baseTick;
+// a server that died mid update leaves the sequence odd, start it over even
+void setupPlayhead(){
+  char name[SHM_NAME_SIZE];
+  segmentName(name, "ph");
+  playhead = mapShared(name, PLAYHEAD_SHM_SIZE);
+  playhead->sequence = 0;
+  __sync_synchronize();
+  publishPlayhead();
+}
+
+// replace a segment with a header and a copy of count items. the segment is
+// recreated because macOS can only size shared memory once.
+void writeSegment(const char* name, struct segmentHeader* header, void* data, size_t itemSize){
+  size_t dataSize = header->count * itemSize;
+  size_t size = sizeof(struct segmentHeader) + dataSize;
+  void* page;
+  int fd;
+  shm_unlink(name);
+  fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if(fd < 0){
+    fprintf(stderr, "** SOUND failed to create shm %s (%s)\n", name, strerror(errno));
+    exit(-1);
+  }
+  if(ftruncate(fd, size) < 0){
+    fprintf(stderr, "** SOUND failed to size shm %s (%s)\n", name, strerror(errno));
+    exit(-1);
+  }
+  page = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(page == MAP_FAILED){
+    fprintf(stderr, "** SOUND failed to map shm %s (%s)\n", name, strerror(errno));
+    exit(-1);
+  }
+  close(fd);
+  memcpy(page, header, sizeof(struct segmentHeader));
+  if(dataSize > 0) memcpy((char*)page + sizeof(struct segmentHeader), data, dataSize);
+  munmap(page, size);
+}
+
+// malloc'd copy of the items in a segment, NULL if it isn't there
+void* readSegment(const char* name, struct segmentHeader* header, size_t itemSize){
+  struct stat st;
+  void* page;
+  void* data;
+  size_t dataSize;
+  int fd = shm_open(name, O_RDONLY, 0600);
+  if(fd < 0) return NULL;
+  if(fstat(fd, &st) < 0 || st.st_size < sizeof(struct segmentHeader)){
+    close(fd);
+    return NULL;
+  }
+  page = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(page == MAP_FAILED) return NULL;
+  memcpy(header, page, sizeof(struct segmentHeader));
+  dataSize = header->count * itemSize;
+  if(sizeof(struct segmentHeader) + dataSize > st.st_size){
+    munmap(page, st.st_size);
+    return NULL;
+  }
+  data = malloc(dataSize + itemSize);
+  if(data == NULL){
+    fprintf(stderr, "** SOUND failed to malloc restored data\n");
+    exit(-1);
+  }
+  memcpy(data, (char*)page + sizeof(struct segmentHeader), dataSize);
+  munmap(page, st.st_size);
+  return data;
+}
+
+// events go in lN, the sysex arena in xN
+void persistLayer(int n, struct sequence* seq){
+  char name[SHM_NAME_SIZE];
+  char arenaName[SHM_NAME_SIZE];
+  char suffix[8];
+  struct segmentHeader header;
+  snprintf(suffix, 8, "l%d", n);
+  segmentName(name, suffix);
+  snprintf(suffix, 8, "x%d", n);
+  segmentName(arenaName, suffix);
+  if(seq == NULL){
+    saved->layers[n].present = 0;
+    shm_unlink(name);
+    shm_unlink(arenaName);
+    return;
+  }
+  header.count = seq->eventCount;
+  header.aux = 0;
+  writeSegment(name, &header, seq->events, sizeof(struct sequencerEvent));
+  header.count = seq->arenaSize;
+  header.aux = seq->sysexCount;
+  writeSegment(arenaName, &header, seq->arena, 1);
+  saved->layers[n].present = 1;
+}
+
+void persistTempoMap(struct tempoMap* tm){
+  char name[SHM_NAME_SIZE];
+  struct segmentHeader header;
+  segmentName(name, "tm");
+  header.count = tm->count;
+  header.aux = tm->ticksPerBeat;
+  writeSegment(name, &header, tm->changes, sizeof(struct tempoChange));
+  saved->ticksPerBeat = ticksPerBeat;
+}
+
+void unlinkSegments(){
+  char name[SHM_NAME_SIZE];
+  char suffix[8];
   int i;
-  struct tempoChange* tempoChanges = seqSnap->tempoChanges;
-  int tempoChangeCount = seqSnap -> tempoChangeCount;
-  if(tempoChangeCount == 0 || targetTick < tempoChanges[i].tick){
-    uspq = DEFAULT_USPQ;
-    baseTick = 0;
+  for(i=0; i<LAYER_MAX; i++){
+    snprintf(suffix, 8, "l%d", i);
+    segmentName(name, suffix);
+    shm_unlink(name);
+    snprintf(suffix, 8, "x%d", i);
+    segmentName(name, suffix);
+    shm_unlink(name);
+  }
+  segmentName(name, "tm");
+  shm_unlink(name);
+  segmentName(name, "st");
+  shm_unlink(name);
+  segmentName(name, "ph");
+  shm_unlink(name);
+}
+
+// while playing the dispatch thread notices the new map and rebases itself
+void swapTempoMap(struct tempoMap* tm){
+  struct tempoMap* old = currentTempoMap;
+  persistTempoMap(tm);
+  if(playFlag){
+    currentTempoMap = tm;
   }
   else{
-    for(i=0; i<tempoChangeCount-1 && targetTick > tempoChanges[i].tick; i++);
-    uspq = tempoChanges[i].uspq;
-    baseTick = tempoChanges[i].tick;
+    rebaseSong(old, tm);
+    currentTempoMap = tm;
+    trashTempoMap(old);
+    emptyTrash();
+    publishPlayhead();
+  }
+}
+
+// like swapTempoMap, the dispatch thread trashes the old one while playing
+void swapLayer(int n, struct sequence* seq){
+  struct sequence* old = layers[n].seq;
+  persistLayer(n, seq);
+  layers[n].seq = seq;
+  if(n >= layerCount) layerCount = n + 1;
+  if(playFlag == 0 && old != NULL) trashSequence(old);
+  if(n == 0) loopGeneration++;
+  emptyTrash();
+}
+
+int validLayer(int n){
+  if(n < 0 || n >= LAYER_MAX){
+    fprintf(stderr, "** SOUND no such layer %d\n", n);
+    return 0;
   }
-  targetNs = (targetTick-baseTick)*1000.0*uspq/ticksPerBeat;
+  return 1;
+}
+
+void executeSeek(int number, int numerator, int denominator){
+  double beat = number + (double)numerator / denominator;
+  uint64_t targetNs = beatToNs(beat);
   if(playFlag == 0){
     songNs = targetNs;
+    publishPlayhead();
   }
   else{
     onlineSeekFlag = 1;
     onlineSeekTargetNs = targetNs;
-    usleep(FRAME_SIZE_NS/1000);
+    usleep(frameNs/1000);
   }
 }
 
@@ -181,7 +671,7 @@ void initPlayingNotes(){
 }
 
 
-void rememberNoteOn(int channel, int note){
+void rememberNoteOn(int channel, int note, int owner){
   int i;
   for(i=0; i<PLAYING_MAX && playingNotes[i].playing==1; i++);
   if(i >= PLAYING_MAX){
@@ -191,6 +681,7 @@ void rememberNoteOn(int channel, int note){
   playingNotes[i].playing = 1;
   playingNotes[i].channel = channel;
   playingNotes[i].note = note;
+  playingNotes[i].owner = owner;
   playingCount++;
 }
 
@@ -212,45 +703,360 @@ void forgetNoteOn(int channel, int note){
   }
 }
 
-// cut all playing notes
-void killAll(){
+// cut the playing notes of the owners in the bit mask
+void killOwned(uint32_t owners){
   unsigned char packetListStorage[PACKET_LIST_SIZE];
   MIDIPacketList* packetList = (MIDIPacketList*) packetListStorage;
   MIDIPacket* packet;
   unsigned char midi[3];
   uint64_t timeOfCut = absoluteLeadingEdgeNs;
   int count = 0;
+  int total = playingCount;
   int i = 0;
 
   packet = MIDIPacketListInit(packetList);
   for(;;){
-    if(count >= playingCount) break;
+    if(count >= total) break;
     if(i >= PLAYING_MAX) break;
     if(playingNotes[i].playing){
-      midi[0] = 0x80 | playingNotes[i].channel;
-      midi[1] = playingNotes[i].note;
-      midi[2] = 0;
-      packet = MIDIPacketListAdd(
-        packetList,
-        PACKET_LIST_SIZE,
-        packet,
-        timeOfCut,
-        3,
-        midi
-      );
-      if(packet == NULL){
-        fprintf(stderr, "** SOUND unable to MIDIPacketListAdd (cut all)\n");
-        exit(-1);
-      }
-      playingNotes[i].playing = 0;
       count++;
+      if(owners & (1u << playingNotes[i].owner)){
+        midi[0] = 0x80 | playingNotes[i].channel;
+        midi[1] = playingNotes[i].note;
+        midi[2] = 0;
+        packet = MIDIPacketListAdd(packetList, PACKET_LIST_SIZE, packet, timeOfCut, 3, midi);
+        if(packet == NULL){ // list full, send what we have and start another
+          MIDIReceived(outputPort, packetList);
+          packet = MIDIPacketListInit(packetList);
+          packet = MIDIPacketListAdd(packetList, PACKET_LIST_SIZE, packet, timeOfCut, 3, midi);
+        }
+        playingNotes[i].playing = 0;
+        playingCount--;
+      }
     }
     i++;
   }
-  playingCount = 0;
   MIDIReceived(outputPort, packetList);
 }
 
+// cut all playing notes
+void killAll(){
+  killOwned(~0u);
+}
+
+
+
+// notes left on by a server that died are unknown to killAll
+void allNotesOff(){
+  unsigned char packetListStorage[PACKET_LIST_SIZE];
+  MIDIPacketList* packetList = (MIDIPacketList*) packetListStorage;
+  MIDIPacket* packet;
+  unsigned char midi[3];
+  uint64_t now = mach_absolute_time();
+  int i;
+
+  packet = MIDIPacketListInit(packetList);
+  for(i=0; i<16; i++){
+    midi[0] = 0xb0 | i;
+    midi[1] = 123;
+    midi[2] = 0;
+    packet = MIDIPacketListAdd(packetList, PACKET_LIST_SIZE, packet, now, 3, midi);
+    if(packet == NULL){
+      fprintf(stderr, "** SOUND unable to MIDIPacketListAdd (all notes off)\n");
+      exit(-1);
+    }
+  }
+  MIDIReceived(outputPort, packetList);
+}
+
+/** latency traces **/
+// with tracing on, video stamps input events and the core sends TRACE with
+// the stamps so far just before the notes the event caused. the stamps are
+// completed here and kept in a ring for TRACE_DUMP and TRACE_HISTOGRAM.
+
+// main thread. take the arrival stamp for an armed trace and return the slot
+// to hand to the event that finishes it, 0 if there is none
+int claimTrace(uint64_t now){
+  int slot;
+  if(traceArmed == 0) return 0;
+  traceArmed = 0;
+  slot = tracePendingNext++ % TRACE_PENDING;
+  tracePending[slot] = armedTrace;
+  tracePending[slot].stamps[HOP_SOUND_IN] = now;
+  return slot + 1;
+}
+
+// called by whichever thread sends the event, with the time it is on the wire
+void finishTrace(int slot, uint64_t sentNs){
+  uint32_t n = __sync_fetch_and_add(&traceWrite, 1);
+  struct trace* t = &traceRing[n % TRACE_RING];
+  t->done = 0;
+  __sync_synchronize();
+  t->id = tracePending[slot-1].id;
+  memcpy(t->stamps, tracePending[slot-1].stamps, sizeof(t->stamps));
+  t->stamps[HOP_MIDI_OUT] = sentNs;
+  __sync_synchronize();
+  t->done = n + 1;
+}
+
+// copy the finished traces into traceCopy, oldest first
+int collectTraces(){
+  uint32_t w = traceWrite;
+  uint32_t i = w - traceCleared > TRACE_RING ? w - TRACE_RING : traceCleared;
+  struct trace* t;
+  int count = 0;
+  for(; i != w; i++){
+    t = &traceRing[i % TRACE_RING];
+    if(t->done != i + 1) continue; // still being written
+    traceCopy[count] = *t;
+    __sync_synchronize();
+    if(t->done == i + 1) count++;
+  }
+  return count;
+}
+
+void dumpTraces(char* path){
+  FILE* out = fopen(path, "w");
+  struct trace* t;
+  int count = collectTraces();
+  int i, j;
+  if(out == NULL){
+    fprintf(stderr, "** SOUND can't open trace file %s: %s\n", path, strerror(errno));
+    return;
+  }
+  fprintf(out, "# id video core-in core-out sound-in midi-out (host ns)\n");
+  for(i=0; i<count; i++){
+    t = &traceCopy[i];
+    fprintf(out, "%u", t->id);
+    for(j=0; j<TRACE_STAMPS; j++) fprintf(out, " %" PRIu64, t->stamps[j]);
+    fprintf(out, "\n");
+  }
+  fclose(out);
+}
+
+int latencyBucket(uint64_t from, uint64_t to){
+  uint64_t us = to > from ? (to - from) / 1000 : 0;
+  int k = 0;
+  while(k < TRACE_BUCKETS-1 && us >= (1ULL << k)) k++;
+  return k;
+}
+
+// one row per hop and one for the whole trip
+void dumpTraceHistogram(char* path){
+  const char* names[TRACE_STAMPS] =
+    {"video-core", "core", "core-sound", "sound", "total"};
+  int counts[TRACE_STAMPS][TRACE_BUCKETS];
+  FILE* out = fopen(path, "w");
+  struct trace* t;
+  int count = collectTraces();
+  int i, j;
+  if(out == NULL){
+    fprintf(stderr, "** SOUND can't open trace file %s: %s\n", path, strerror(errno));
+    return;
+  }
+  memset(counts, 0, sizeof(counts));
+  for(i=0; i<count; i++){
+    t = &traceCopy[i];
+    for(j=0; j<TRACE_STAMPS-1; j++){
+      counts[j][latencyBucket(t->stamps[j], t->stamps[j+1])]++;
+    }
+    counts[TRACE_STAMPS-1][latencyBucket(t->stamps[HOP_VIDEO], t->stamps[HOP_MIDI_OUT])]++;
+  }
+  fprintf(out, "# %d traces, column k counts latencies under 2^k us, the last the rest\n", count);
+  for(i=0; i<TRACE_STAMPS; i++){
+    fprintf(out, "%s", names[i]);
+    for(j=0; j<TRACE_BUCKETS; j++) fprintf(out, " %d", counts[i][j]);
+    fprintf(out, "\n");
+  }
+  fclose(out);
+}
+
+/** live events **/
+// the main thread puts scheduled events in the inbox. they are taken out and
+// played by whichever thread owns the midi output and the on-note list, the
+// dispatch thread while playing and the live thread while stopped.
+
+// 0 for anything that isn't a channel voice message
+int voiceMessageSize(uint8_t status){
+  switch(status & 0xf0){
+    case 0x80: case 0x90: case 0xa0: case 0xb0: case 0xe0: return 3;
+    case 0xc0: case 0xd0: return 2;
+    default: return 0;
+  }
+}
+
+// main thread only. returns -1 if the inbox is full.
+int scheduleLive(uint64_t when, int status, int arg1, int arg2, int sent, int trace){
+  struct liveEvent* ev;
+  if(liveInboxWrite - liveInboxRead >= LIVE_MAX) return -1;
+  ev = &liveInbox[liveInboxWrite % LIVE_MAX];
+  ev->when = when;
+  ev->serial = liveSerial++;
+  ev->midi[0] = status;
+  ev->midi[1] = arg1;
+  ev->midi[2] = arg2;
+  ev->sent = sent;
+  ev->trace = trace;
+  __sync_synchronize();
+  liveInboxWrite++;
+  return 0;
+}
+
+int liveBefore(struct liveEvent* a, struct liveEvent* b){
+  return a->when < b->when || (a->when == b->when && a->serial < b->serial);
+}
+
+void pushLive(struct liveEvent* ev){
+  struct liveEvent tmp;
+  int i = livePendingCount;
+  int parent;
+  if(livePendingCount >= LIVE_MAX){
+    fprintf(stderr, "SOUND too many live events pending, dropping one\n");
+    return;
+  }
+  livePending[livePendingCount++] = *ev;
+  while(i > 0){
+    parent = (i - 1) / 2;
+    if(!liveBefore(&livePending[i], &livePending[parent])) break;
+    tmp = livePending[i];
+    livePending[i] = livePending[parent];
+    livePending[parent] = tmp;
+    i = parent;
+  }
+}
+
+void popLive(struct liveEvent* out){
+  struct liveEvent tmp;
+  int i = 0;
+  int child;
+  *out = livePending[0];
+  livePending[0] = livePending[--livePendingCount];
+  for(;;){
+    child = 2*i + 1;
+    if(child >= livePendingCount) break;
+    if(child+1 < livePendingCount &&
+       liveBefore(&livePending[child+1], &livePending[child])) child++;
+    if(!liveBefore(&livePending[child], &livePending[i])) break;
+    tmp = livePending[i];
+    livePending[i] = livePending[child];
+    livePending[child] = tmp;
+    i = child;
+  }
+}
+
+void trackNote(uint8_t* midi){
+  if((midi[0] & 0xf0) == 0x90 && midi[2] > 0){
+    rememberNoteOn(midi[0] & 0x0f, midi[1], OWNER_LIVE);
+  }
+  if((midi[0] & 0xf0) == 0x80 || ((midi[0] & 0xf0) == 0x90 && midi[2] == 0)){
+    forgetNoteOn(midi[0] & 0x0f, midi[1]);
+  }
+}
+
+void collectLive(){
+  uint32_t w = liveInboxWrite;
+  uint32_t r;
+  struct liveEvent* ev;
+  __sync_synchronize();
+  for(r = liveInboxRead; r != w; r++){
+    ev = &liveInbox[r % LIVE_MAX];
+    if(ev->sent) trackNote(ev->midi);
+    else if(livePendingCount >= LIVE_MAX) break; // left in the inbox
+    else pushLive(ev);
+  }
+  __sync_synchronize();
+  liveInboxRead = r;
+}
+
+// forget everything scheduled, for CUT_ALL
+void dropLive(){
+  collectLive();
+  livePendingCount = 0;
+}
+
+// a sysex is streamed over several frames. live events due once it has
+// started are held back in the live heap until it's done, so they don't land
+// inside it on the wire. the sequence itself waits at the sysex, see
+// dispatchFrame. owner thread only.
+int voiceHeld(uint64_t when){
+  return sysexPending > 0 && when >= sysexQueue[sysexHead].when;
+}
+
+// the time a voice event can go out, after any sysex bytes sent before it
+uint64_t voiceTime(uint64_t when){
+  return when > sysexBusyUntilNs ? when : sysexBusyUntilNs;
+}
+
+// play the scheduled events due before untilNs, at their own times
+void dispatchLive(uint64_t untilNs){
+  unsigned char packetListStorage[PACKET_LIST_SIZE];
+  MIDIPacketList* packetList = (MIDIPacketList*) packetListStorage;
+  MIDIPacket* packet;
+  struct liveEvent ev;
+  uint8_t* midi;
+  int size;
+  uint64_t now;
+
+  collectLive();
+  if(livePendingCount == 0 || livePending[0].when >= untilNs) return;
+  if(voiceHeld(livePending[0].when)) return;
+
+  now = mach_absolute_time();
+  packet = MIDIPacketListInit(packetList);
+  while(livePendingCount > 0 && livePending[0].when < untilNs &&
+        !voiceHeld(livePending[0].when)){
+    popLive(&ev);
+    midi = ev.midi;
+    size = voiceMessageSize(midi[0]);
+    ev.when = voiceTime(ev.when);
+    trackNote(midi);
+    if(ev.trace) finishTrace(ev.trace, ev.when > now ? ev.when : now);
+    packet = MIDIPacketListAdd(packetList, PACKET_LIST_SIZE, packet, ev.when, size, midi);
+    if(packet == NULL){ // list full, send what we have and start another
+      MIDIReceived(outputPort, packetList);
+      packet = MIDIPacketListInit(packetList);
+      packet = MIDIPacketListAdd(packetList, PACKET_LIST_SIZE, packet, ev.when, size, midi);
+    }
+  }
+  MIDIReceived(outputPort, packetList);
+}
+
+// while stopped, live events are played from here with the same lookahead
+// the dispatch thread has while playing. events stamped one frame after they
+// arrive are always sent before they are due.
+void* liveWorker(){
+  while(liveFlag){
+    if(cutAllFlag){
+      dropLive();
+      killAll();
+      cutAllFlag = 0;
+    }
+    dispatchLive(mach_absolute_time() + 2*frameNs);
+    usleep(frameNs/1000);
+  }
+  return NULL;
+}
+
+void spawnLiveThread(){
+  int ret;
+  liveFlag = 1;
+  ret = pthread_create(&liveThread, NULL, liveWorker, NULL);
+  if(ret){
+    fprintf(stderr,"SOUND live thread failed to create: %s\n",strerror(errno));
+    exit(-1);
+  }
+}
+
+void joinLiveThread(){
+  int ret;
+  liveFlag = 0;
+  ret = pthread_join(liveThread, NULL);
+  if(ret){
+    fprintf(stderr, "SOUND live thread failed to join: %s\n", strerror(ret));
+    exit(-1);
+  }
+}
+
 
 
 /** the capture buffer **/
@@ -311,26 +1117,178 @@ int ringWrite(char* src, int count){
 }
 */
 
+void publishFrameClock(uint64_t absNs, uint64_t atSongNs, double scale){
+  frameClock.sequence++;
+  __sync_synchronize();
+  frameClock.absNs = absNs;
+  frameClock.songNs = atSongNs;
+  frameClock.scale = scale;
+  __sync_synchronize();
+  frameClock.sequence++;
+}
+
+// song time at an absolute time, folded back into the loop when looping.
+// the frame clock is published after a wrap, so a time from just before it
+// extrapolates to before the loop start and belongs at the end of the loop.
+uint64_t songNsAt(uint64_t absNs){
+  uint32_t s0;
+  uint64_t baseAbsNs;
+  uint64_t baseSongNs;
+  double scale;
+  int64_t at;
+  do{
+    s0 = frameClock.sequence;
+    __sync_synchronize();
+    baseAbsNs = frameClock.absNs;
+    baseSongNs = frameClock.songNs;
+    scale = frameClock.scale;
+    __sync_synchronize();
+  } while((s0 & 1) || s0 != frameClock.sequence);
+  at = baseSongNs + ((int64_t)absNs - (int64_t)baseAbsNs) * scale;
+  if(loopFlag && loopEndNs > loopStartNs){
+    if(at >= (int64_t)loopEndNs){
+      at = loopStartNs + (at - loopEndNs) % (loopEndNs - loopStartNs);
+    }
+    else if(at < (int64_t)loopStartNs && baseSongNs >= loopStartNs){
+      at = loopEndNs - (loopStartNs - at) % (loopEndNs - loopStartNs);
+    }
+  }
+  if(at < 0) at = 0;
+  return at;
+}
+
+// called from the capture thread only. when the take is full the event is
+// dropped, reported once per take.
+void recordEvent(struct take* tk, uint32_t tick, uint8_t* midi, int size){
+  int n = tk->count;
+  if(n >= TAKE_SIZE){
+    if(tk->dropped == 0) fprintf(stderr, "** SOUND take is full, dropping input\n");
+    tk->dropped = 1;
+    return;
+  }
+  if(n == 0 || tick < tk->lastTick){
+    if(tk->runCount >= TAKE_RUNS){
+      if(tk->dropped == 0) fprintf(stderr, "** SOUND take has no loop passes left, dropping input\n");
+      tk->dropped = 1;
+      return;
+    }
+    tk->runStart[tk->runCount] = n;
+    __sync_synchronize();
+    tk->runCount++;
+  }
+  tk->events[n].tick = tick;
+  tk->events[n].typeChan = midi[0];
+  tk->events[n].arg1 = midi[1];
+  tk->events[n].arg2 = size == 3 ? midi[2] : 0;
+  tk->lastTick = tick;
+  __sync_synchronize();
+  tk->count = n + 1;
+}
+
+// make everything recorded so far audible
+void commitTakes(){
+  int i;
+  for(i=0; i<takeCount; i++){
+    takes[i]->visible = takes[i]->count;
+  }
+}
+
+struct take* newTake(){
+  struct take* tk;
+  if(takeCount >= TAKE_MAX){
+    fprintf(stderr, "** SOUND no room for another take, CLEAR_CAPTURE first\n");
+    return NULL;
+  }
+  tk = calloc(1, sizeof(struct take));
+  if(tk == NULL){
+    fprintf(stderr, "** SOUND failed to malloc take\n");
+    exit(-1);
+  }
+  takes[takeCount] = tk;
+  __sync_synchronize();
+  takeCount++;
+  return tk;
+}
+
+// the dispatch thread must not be running. waits out a capture callback
+// that may still be writing into a take.
+void clearTakes(){
+  int i;
+  int n = takeCount;
+  captureFlag = 0;
+  recordingTake = NULL;
+  takeCount = 0;
+  __sync_synchronize();
+  while(captureBusy) usleep(100);
+  for(i=0; i<n; i++){
+    free(takes[i]);
+    takes[i] = NULL;
+  }
+}
+
+// print events captured since the last CAPTURE, 7 bytes in hex per line
+void dumpCapture(){
+  int i, j;
+  struct take* tk;
+  int n;
+  for(i=0; i<takeCount; i++){
+    tk = takes[i];
+    n = tk->count;
+    for(j=tk->reported; j<n; j++){
+      fprintf(stdout, "%08x%02x%02x%02x\n",
+        tk->events[j].tick,
+        tk->events[j].typeChan,
+        tk->events[j].arg1,
+        tk->events[j].arg2
+      );
+    }
+    tk->reported = n;
+  }
+  fprintf(stdout, "end\n");
+  fflush(stdout);
+}
+
 void midiNotification(const MIDINotification* message, void* refCon){
   fprintf(stderr, "midiNotification\n");
 }
 
+// stamp incoming voice messages against the song clock and append them to
+// the recording take. realtime bytes are skipped, sysex ends the packet.
+// captureBusy keeps the garbage thread off the tempo map and clearTakes off
+// the take while they're in use.
 void captureWorker(const MIDIPacketList* packetList, void* refCon, void* srcConn){
   uint64_t now = mach_absolute_time();
   const MIDIPacket* packet = &packetList->packet[0];
-  int i;
-  fprintf(stderr, "captureWorker (%d packets)\n", packetList->numPackets);
+  struct take* tk;
+  struct tempoMap* tm;
+  uint8_t* data;
+  uint32_t tick;
+  int i, j;
+  int size;
+  captureBusy = 1;
+  __sync_synchronize();
+  tk = recordingTake;
+  tm = currentTempoMap;
+  if(captureFlag == 0 || playFlag == 0 || tk == NULL){
+    captureBusy = 0;
+    return;
+  }
   for(i=0; i<packetList->numPackets; i++){
-    printf("%llu %llu %d: %x %d %d\n",
-      now,
-      packet->timeStamp,
-      packet->length,
-      packet->data[0],
-      packet->data[1],
-      packet->data[2]
-    );
+    data = (uint8_t*) packet->data;
+    tick = nsToTick(tm, songNsAt(packet->timeStamp ? packet->timeStamp : now)) + 0.5;
+    for(j=0; j<packet->length; j+=size){
+      if(data[j] >= 0xf8){
+        size = 1;
+        continue;
+      }
+      size = voiceMessageSize(data[j]);
+      if(size == 0 || j + size > packet->length) break;
+      recordEvent(tk, tick, data + j, size);
+    }
     packet = MIDIPacketNext(packet);
   }
+  __sync_synchronize();
+  captureBusy = 0;
 }
 
 int setupCoreMidi(){
@@ -376,6 +1334,7 @@ int setupCoreMidi(){
   return 0;
 }
 
+// NULL if the dump is truncated or has a zero tempo or ticks going backwards
 struct tempoChange* loadTempoChangeData(FILE* tempoFile, int* count){
   int tempoMax = 32;
   int tempoPtr = 0;
@@ -391,10 +1350,17 @@ struct tempoChange* loadTempoChangeData(FILE* tempoFile, int* count){
     if(bytesRead == 0) break;
     if(bytesRead != 7) {
       fprintf(stderr, "** SOUND tempo data file ends with %d bytes not 7\n", bytesRead);
-      exit(-1);
+      free(tempoBuf);
+      return NULL;
     }
     tempoBuf[tempoPtr].tick = seven[0]<<24 | seven[1]<<16 | seven[2]<<8 | seven[3];
     tempoBuf[tempoPtr].uspq = seven[4]<<16 | seven[5]<<8  | seven[6];
+    if(tempoBuf[tempoPtr].uspq == 0 ||
+       (tempoPtr > 0 && tempoBuf[tempoPtr].tick < tempoBuf[tempoPtr-1].tick)){
+      fprintf(stderr, "** SOUND tempo change %d is out of order or zero\n", tempoPtr);
+      free(tempoBuf);
+      return NULL;
+    }
     tempoPtr++;
     if(tempoPtr == tempoMax){
       tempoBuf = realloc(tempoBuf, tempoMax*2*sizeof(struct tempoChange));
@@ -409,188 +1375,811 @@ struct tempoChange* loadTempoChangeData(FILE* tempoFile, int* count){
   return tempoBuf;
 }
 
-struct sequencerEvent* loadSequenceData(FILE* sequenceFile, int* count){
-  int eventMax = 256;
-  int eventPtr = 0;
-  int bytesRead;
-  unsigned char seven[7];
-  struct sequencerEvent* eventBuf = malloc(eventMax * sizeof(struct sequencerEvent));
-  if(eventBuf == NULL){
-    fprintf(stderr, "** SOUND malloc of eventBuf failed\n");
+uint32_t be32(const unsigned char* p){
+  return (uint32_t)p[0]<<24 | p[1]<<16 | p[2]<<8 | p[3];
+}
+
+struct sequencerEvent* allocEvents(int count){
+  struct sequencerEvent* events = malloc((count + 1) * sizeof(struct sequencerEvent));
+  if(events == NULL){
+    fprintf(stderr, "** SOUND malloc of %d events failed\n", count);
     exit(-1);
   }
-  for(;;){
-    bytesRead = fread(seven, 1, 7, sequenceFile);
-    if(bytesRead == 0) break;
-    if(bytesRead != 7) {
-      fprintf(stderr,
-        "** SOUND sequence data file ends with %d bytes not 7\n", bytesRead);
+  return events;
+}
+
+// returns the index of the sysex in the arena, -1 if there are too many
+int addSysex(struct arenaBuilder* ab, unsigned char* data, uint32_t length){
+  if(ab->count >= SYSEX_MAX){
+    fprintf(stderr, "** SOUND more than %d sysex events in a sequence\n", SYSEX_MAX);
+    return -1;
+  }
+  if(ab->count == ab->refMax){
+    ab->refMax = ab->refMax ? ab->refMax * 2 : 16;
+    ab->refs = realloc(ab->refs, ab->refMax * sizeof(struct sysexRef));
+  }
+  while(ab->size + length > ab->max){
+    ab->max = ab->max ? ab->max * 2 : 4096;
+    ab->bytes = realloc(ab->bytes, ab->max);
+  }
+  if(ab->refs == NULL || ab->bytes == NULL){
+    fprintf(stderr, "** SOUND failed to grow sysex arena\n");
+    exit(-1);
+  }
+  ab->refs[ab->count].offset = ab->size;
+  ab->refs[ab->count].length = length;
+  memcpy(ab->bytes + ab->size, data, length);
+  ab->size += length;
+  return ab->count++;
+}
+
+// refs then payload in one block, offsets moved past the refs
+void finishArena(struct arenaBuilder* ab, struct sequence* seq){
+  uint32_t refSize = ab->count * sizeof(struct sysexRef);
+  int i;
+  seq->sysexCount = ab->count;
+  seq->arenaSize = 0;
+  seq->arena = NULL;
+  if(ab->count > 0){
+    seq->arenaSize = refSize + ab->size;
+    seq->arena = malloc(seq->arenaSize);
+    if(seq->arena == NULL){
+      fprintf(stderr, "** SOUND malloc of sysex arena failed\n");
       exit(-1);
     }
-    eventBuf[eventPtr].tick = seven[0]<<24 | seven[1]<<16 | seven[2]<<8 | seven[3];
-    eventBuf[eventPtr].typeChan = seven[4];
-    eventBuf[eventPtr].arg1 = seven[5];
-    eventBuf[eventPtr].arg2 = seven[6];
-    eventPtr++;
-    if(eventPtr == eventMax){
-      eventBuf = realloc(eventBuf, eventMax*2*sizeof(struct sequencerEvent));
-      if(eventBuf == NULL){
-        fprintf(stderr, "** SOUND failed to realloc event buffer\n");
-        exit(-1);
-      }
-      eventMax *= 2;
-    }
+    for(i=0; i<ab->count; i++) ab->refs[i].offset += refSize;
+    memcpy(seq->arena, ab->refs, refSize);
+    memcpy(seq->arena + refSize, ab->bytes, ab->size);
   }
-  *count = eventPtr;
-  return eventBuf;
+  free(ab->refs);
+  free(ab->bytes);
 }
 
+void setSysexIndex(struct sequencerEvent* ev, int index){
+  ev->arg1 = index >> 8;
+  ev->arg2 = index & 0xff;
+}
 
-void recomputeEventTimes(
-  struct sequencerEvent* events,
-  int eventCount,
-  struct tempoChange* tempoChanges,
-  int tempoCount,
-  uint32_t ticksPerBeat
+// the original format, 4 byte tick and 3 midi bytes per event. a sysex is
+// a tick, 0xf0 and a 16 bit length, followed by that many bytes.
+struct sequencerEvent* decodeRawSequence(
+  unsigned char* data,
+  size_t size,
+  int* count,
+  struct arenaBuilder* ab
 ){
-  int i, j;
-  uint32_t default_uspq = DEFAULT_USPQ;
-  uint32_t uspq = default_uspq;
-  uint64_t prevNs = 0;
-  uint32_t prevTick = 0;
-  uint32_t deltaTicks;
-  for(i=0, j=0; i < tempoCount; i++){
-    deltaTicks = tempoChanges[i].tick - prevTick;
-    tempoChanges[i].atNs = prevNs + deltaTicks*1000.0*uspq / ticksPerBeat;
+  struct sequencerEvent* events;
+  size_t pos;
+  uint32_t length;
+  int index;
+  int n = 0;
+  int i;
+  for(pos = 0; pos + 7 <= size; pos += 7, n++){
+    if(data[pos+4] == 0xf0) pos += data[pos+5] << 8 | data[pos+6];
+  }
+  if(pos > size){
+    fprintf(stderr, "** SOUND sequence data file ends inside a sysex\n");
+    return NULL;
+  }
+  if(pos != size){
+    fprintf(stderr,
+      "** SOUND sequence data file ends with %d bytes not 7\n", (int)(size - pos));
+    return NULL;
+  }
+  events = allocEvents(n);
+  for(i=0; i<n; i++, data += 7){
+    events[i].tick = be32(data);
+    events[i].typeChan = data[4];
+    events[i].arg1 = data[5];
+    events[i].arg2 = data[6];
+    if(data[4] == 0xf0){
+      length = data[5] << 8 | data[6];
+      index = addSysex(ab, data + 7, length);
+      if(index < 0){
+        free(events);
+        return NULL;
+      }
+      setSysexIndex(&events[i], index);
+      data += length;
+    }
+    else if(voiceMessageSize(data[4]) == 0 || data[5] > 0x7f ||
+            (voiceMessageSize(data[4]) == 3 && data[6] > 0x7f)){
+      fprintf(stderr,
+        "** SOUND invalid event %d in sequence dump (%02x %02x %02x)\n",
+        i, data[4], data[5], data[6]);
+      free(events);
+      return NULL;
+    }
+  }
+  *count = n;
+  return events;
+}
+// returns NULL for the decoder to pass on
+struct sequencerEvent* corruptCompact(struct sequencerEvent* events, const char* why){
+  fprintf(stderr, "** SOUND corrupt compact sequence dump (%s)\n", why);
+  free(events);
+  return NULL;
+}
 
-    for(;;){
-      if(j >= eventCount) break;
-      deltaTicks = events[j].tick - prevTick;
-      events[j].atNs = prevNs + deltaTicks*1000.0*uspq / ticksPerBeat;
-      if(events[j].atNs <= tempoChanges[i].atNs) j++;
-      else break;
+// compact format, see the manual. the header gives the event count so the
+// array is allocated once, and each block restarts its tick and running
+// status, so blocks decode independently of each other.
+struct sequencerEvent* decodeCompactSequence(
+  unsigned char* data,
+  size_t size,
+  int* count,
+  struct arenaBuilder* ab
+){
+  struct sequencerEvent* events = NULL;
+  struct sequencerEvent* ev;
+  unsigned char* index;
+  unsigned char* body;
+  unsigned char* p;
+  unsigned char* end;
+  size_t bodySize;
+  size_t from;
+  size_t to;
+  uint32_t n;
+  uint32_t blocks;
+  uint32_t blockSize;
+  uint32_t b;
+  uint32_t i;
+  uint32_t inBlock;
+  uint32_t v;
+  uint32_t tick;
+  uint8_t status;
+  int shift;
+  int midiSize;
+  int sysexIndex;
+
+  if(size < COMPACT_HEADER_SIZE) return corruptCompact(events, "short header");
+  n = be32(data + 4);
+  blocks = be32(data + 8);
+  blockSize = be32(data + 12);
+  if(n > INT32_MAX / sizeof(struct sequencerEvent)){
+    return corruptCompact(events, "event count");
+  }
+  if(blockSize == 0 || blocks != (n + blockSize - 1) / blockSize){
+    return corruptCompact(events, "block count");
+  }
+  if((size - COMPACT_HEADER_SIZE) / 8 < blocks) return corruptCompact(events, "short index");
+  index = data + COMPACT_HEADER_SIZE;
+  body = index + 8*blocks;
+  bodySize = size - (body - data);
+  // every event takes at least 2 bytes, a delta and a data or length byte
+  if(n > bodySize / 2) return corruptCompact(events, "event count");
+
+  events = allocEvents(n);
+  ev = events;
+  for(b=0; b<blocks; b++){
+    tick = be32(index + 8*b);
+    from = be32(index + 8*b + 4);
+    to = b+1 < blocks ? be32(index + 8*(b+1) + 4) : bodySize;
+    if(from > to || to > bodySize) return corruptCompact(events, "block offset");
+    p = body + from;
+    end = body + to;
+    status = 0;
+    inBlock = n - b*blockSize < blockSize ? n - b*blockSize : blockSize;
+    for(i=0; i<inBlock; i++){
+      // delta tick shifted left once, low bit set if a status byte follows.
+      // little endian base 128, almost always a single byte.
+      if(p < end && *p < 0x80){
+        v = *p++;
+      }
+      else{
+        v = 0;
+        shift = 0;
+        do{
+          if(p == end || shift > 28) return corruptCompact(events, "delta");
+          v |= (uint32_t)(*p & 0x7f) << shift;
+          shift += 7;
+        } while(*p++ & 0x80);
+      }
+      tick += v >> 1;
+      if(v & 1){
+        if(p == end) return corruptCompact(events, "status");
+        status = *p++;
+      }
+      ev->tick = tick;
+      ev->typeChan = status;
+      if(status == 0xf0){ // varint length then the bytes after 0xf0
+        v = 0;
+        shift = 0;
+        do{
+          if(p == end || shift > 28) return corruptCompact(events, "sysex length");
+          v |= (uint32_t)(*p & 0x7f) << shift;
+          shift += 7;
+        } while(*p++ & 0x80);
+        if(v > 0xffff) return corruptCompact(events, "sysex too long");
+        if(end - p < v) return corruptCompact(events, "truncated sysex");
+        sysexIndex = addSysex(ab, p, v);
+        if(sysexIndex < 0) return corruptCompact(events, "too many sysex");
+        setSysexIndex(ev, sysexIndex);
+        p += v;
+        ev++;
+        continue;
+      }
+      midiSize = voiceMessageSize(status);
+      if(midiSize == 0) return corruptCompact(events, "status");
+      if(end - p < midiSize - 1) return corruptCompact(events, "truncated event");
+      if(p[0] > 0x7f || (midiSize == 3 && p[1] > 0x7f)){
+        return corruptCompact(events, "data byte");
+      }
+      ev->arg1 = p[0];
+      ev->arg2 = midiSize == 3 ? p[1] : 0;
+      p += midiSize - 1;
+      ev++;
     }
+    if(p != end) return corruptCompact(events, "block length");
+  }
+  *count = n;
+  return events;
+}
+
+int noteOffEvent(struct sequencerEvent* ev){
+  return (ev->typeChan & 0xf0) == 0x80 ||
+    ((ev->typeChan & 0xf0) == 0x90 && ev->arg2 == 0);
+}
+
+// events at the same tick play note offs first, so a note ending where the
+// same note starts again doesn't cut the new one
+int eventBefore(struct sequencerEvent* a, struct sequencerEvent* b){
+  return a->tick < b->tick ||
+    (a->tick == b->tick && noteOffEvent(a) && !noteOffEvent(b));
+}
 
-    prevTick = tempoChanges[i].tick;
-    prevNs = tempoChanges[i].atNs;
-    uspq = tempoChanges[i].uspq;
+// stable counting sort pass on one byte of the tick, or on note off first
+// when shift is negative
+void radixPass(struct sequencerEvent* from, struct sequencerEvent* to, int n, int shift){
+  int counts[256];
+  int i, k, sum;
+  memset(counts, 0, sizeof(counts));
+  for(i=0; i<n; i++){
+    k = shift < 0 ? !noteOffEvent(&from[i]) : from[i].tick >> shift & 0xff;
+    counts[k]++;
+  }
+  for(sum=0, k=0; k<256; k++){
+    i = counts[k];
+    counts[k] = sum;
+    sum += i;
+  }
+  for(i=0; i<n; i++){
+    k = shift < 0 ? !noteOffEvent(&from[i]) : from[i].tick >> shift & 0xff;
+    to[counts[k]++] = from[i];
   }
+}
 
-  for(;;){
-    if(j >= eventCount) break;
-    deltaTicks = events[j].tick - prevTick;
-    events[j].atNs = prevNs + deltaTicks*1000.0*uspq / ticksPerBeat;
-    j++;
+// the dispatcher needs events in tick order, dumps may come in any order.
+// least significant first, skipping tick bytes that are the same throughout.
+// sysex events keep their arena index so they can move like any other.
+void sortEvents(struct sequencerEvent* events, int n){
+  struct sequencerEvent* scratch;
+  struct sequencerEvent* from = events;
+  struct sequencerEvent* to;
+  struct sequencerEvent* tmp;
+  uint32_t all;
+  uint32_t any = 0;
+  int shift;
+  int i;
+
+  for(i=1; i<n; i++){
+    if(eventBefore(&events[i], &events[i-1])) break;
   }
+  if(i >= n) return;
 
+  scratch = allocEvents(n);
+  to = scratch;
+  all = ~0;
+  for(i=0; i<n; i++){
+    all &= events[i].tick;
+    any |= events[i].tick;
+  }
+  radixPass(from, to, n, -1);
+  tmp = from; from = to; to = tmp;
+  for(shift=0; shift<32; shift+=8){
+    if(((all ^ any) >> shift & 0xff) == 0) continue;
+    radixPass(from, to, n, shift);
+    tmp = from; from = to; to = tmp;
+  }
+  if(from != events) memcpy(events, from, n * sizeof(struct sequencerEvent));
+  free(scratch);
+}
+
+// read the whole dump and decode it in memory, either format. -1 if the
+// file can't be read or isn't a valid dump.
+int loadSequenceData(FILE* sequenceFile, struct sequence* seq){
+  struct arenaBuilder ab = {0, 0, NULL, 0, 0, NULL};
+  unsigned char* data;
+  long size;
+
+  if(fseek(sequenceFile, 0, SEEK_END) ||
+     (size = ftell(sequenceFile)) < 0 ||
+     fseek(sequenceFile, 0, SEEK_SET)){
+    fprintf(stderr, "** SOUND failed to size sequence file (%s)\n", strerror(errno));
+    return -1;
+  }
+  data = malloc(size + 1);
+  if(data == NULL){
+    fprintf(stderr, "** SOUND malloc of sequence file buffer failed\n");
+    exit(-1);
+  }
+  if(fread(data, 1, size, sequenceFile) != (size_t)size){
+    fprintf(stderr, "** SOUND failed to read sequence file\n");
+    free(data);
+    return -1;
+  }
+  if(size >= 4 && be32(data) == COMPACT_MAGIC){
+    seq->events = decodeCompactSequence(data, size, &seq->eventCount, &ab);
+  }
+  else{
+    seq->events = decodeRawSequence(data, size, &seq->eventCount, &ab);
+  }
+  free(data);
+  if(seq->events == NULL){
+    free(ab.refs);
+    free(ab.bytes);
+    return -1;
+  }
+  sortEvents(seq->events, seq->eventCount);
+  finishArena(&ab, seq);
+  return 0;
 }
 
+
 int prefix(const char *pre, const char *str)
 {
   return strncmp(pre, str, strlen(pre)) == 0;
 }
 
-// load raw sequence and tempo data from two files, then delete the files
-struct sequence* loadData(char* sequencePath, char* tempoPath){
+// load a raw tempo change dump. the ns positions of the changes are
+// worked out here using the current ticks per beat.
+// NULL if the file can't be read or isn't a valid tempo dump
+struct tempoMap* loadTempoMap(char* tempoPath){
   FILE* tempoFile;
-  FILE* sequenceFile;
-  struct sequencerEvent* events;
-  struct tempoChange* tempoChanges;
-  int eventCount;
-  int tempoChangeCount;
-  struct sequence* seq;
+  struct tempoMap* tm;
 
-  if(!prefix("/tmp/epichord-", sequencePath)){
-    fprintf(stderr, "** refuse to load file from this location (%s)\n", sequencePath);
-    exit(-1);
-  }
   if(!prefix("/tmp/epichord-", tempoPath)){
     fprintf(stderr, "** refuse to load file from this location (%s)\n", tempoPath);
-    exit(-1);
+    return NULL;
   }
 
   tempoFile = fopen(tempoPath, "r");
   if(tempoFile == NULL){
     fprintf(stderr,
       "SOUND failed to open tempo file: %s %s\n", tempoPath, strerror(errno));
-    exit(-1);
+    return NULL;
+  }
+
+  tm = malloc(sizeof(struct tempoMap));
+  if(tm == NULL){
+    fprintf(stderr, "** SOUND failed to malloc tempo map\n");
+    exit(-3);
   }
-  tempoChanges = loadTempoChangeData(tempoFile, &tempoChangeCount);
+  tm->ticksPerBeat = ticksPerBeat;
+  tm->changes = loadTempoChangeData(tempoFile, &tm->count);
   fclose(tempoFile);
+  if(tm->changes == NULL){
+    free(tm);
+    return NULL;
+  }
+
+  computeTempoTimes(tm);
+  return tm;
+}
+
+// same tempo changes under a different beat resolution
+struct tempoMap* retimeTempoMap(struct tempoMap* src, uint32_t tpb){
+  struct tempoMap* tm = malloc(sizeof(struct tempoMap));
+  if(tm == NULL){
+    fprintf(stderr, "** SOUND failed to malloc tempo map\n");
+    exit(-3);
+  }
+  tm->ticksPerBeat = tpb;
+  tm->count = src->count;
+  tm->changes = malloc((src->count + 1) * sizeof(struct tempoChange));
+  if(tm->changes == NULL){
+    fprintf(stderr, "** SOUND failed to malloc tempo changes\n");
+    exit(-3);
+  }
+  memcpy(tm->changes, src->changes, src->count * sizeof(struct tempoChange));
+  computeTempoTimes(tm);
+  return tm;
+}
+
+// load a raw sequence dump. event times are not computed here, the
+// dispatcher maps ticks to time through the tempo map as it goes.
+struct sequence* loadSequence(char* sequencePath){
+  FILE* sequenceFile;
+  struct sequence* seq;
+
+  if(!prefix("/tmp/epichord-", sequencePath)){
+    fprintf(stderr, "** refuse to load file from this location (%s)\n", sequencePath);
+    return NULL;
+  }
 
   sequenceFile = fopen(sequencePath, "r");
   if(sequenceFile == NULL){
     fprintf(stderr,
       "SOUND failed to open sequence file: %s %s\n", sequencePath, strerror(errno));
-    exit(-1);
+    return NULL;
   }
-  events = loadSequenceData(sequenceFile, &eventCount);
-  fclose(sequenceFile);
-
-  recomputeEventTimes(events, eventCount, tempoChanges, tempoChangeCount, ticksPerBeat);
 
   seq = malloc(sizeof(struct sequence));
   if(seq == NULL){
     fprintf(stderr, "** SOUND failed to malloc sequence\n");
     exit(-3);
   }
-  seq->eventCount = eventCount;
-  seq->tempoChangeCount = tempoChangeCount;
-  seq->events = events;
-  seq->tempoChanges = tempoChanges;
+  if(loadSequenceData(sequenceFile, seq) < 0){
+    fclose(sequenceFile);
+    free(seq);
+    return NULL;
+  }
+  fclose(sequenceFile);
 /*
   if(unlink(sequencePath)){
     fprintf(stderr, "** SOUND failed to remove dump file (%s)\n", strerror(errno));
     exit(-1);
   }
-  if(unlink(tempoPath)){
-    fprintf(stderr, "** SOUND failed to remove dump file (%s)\n", strerror(errno));
-    exit(-1);
-  }
-  
 */
   return seq;
 }
 
 
+// index of the first event at or after tick
+int lowerBoundTick(struct sequencerEvent* events, int count, double tick){
+  int lo = 0;
+  int hi = count;
+  int mid;
+  while(lo < hi){
+    mid = lo + (hi - lo) / 2;
+    if(events[mid].tick < tick) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+// song ticks [fromTick, toTick) of events placed at base
+int addCursor(
+  struct cursor* cursors,
+  int n,
+  struct sequencerEvent* events,
+  int count,
+  double fromTick,
+  double toTick,
+  int64_t base,
+  struct sequence* seq
+){
+  int a = lowerBoundTick(events, count, fromTick - base);
+  int b = lowerBoundTick(events, count, toTick - base);
+  if(a < b){
+    cursors[n].at = events + a;
+    cursors[n].end = events + b;
+    cursors[n].base = base;
+    cursors[n].seq = seq;
+    n++;
+  }
+  return n;
+}
+
+// a looping layer gets one cursor per pass that overlaps the range, up to
+// LAYER_PIECES of them
+int layerCursors(
+  struct cursor* cursors,
+  int n,
+  struct layer* ly,
+  struct sequence* seq,
+  double fromTick,
+  double toTick
+){
+  int64_t offset = ly->offset;
+  uint32_t loopTicks = ly->loopTicks;
+  int64_t pass;
+  int64_t passStart;
+  int p;
+  if(loopTicks == 0){
+    return addCursor(cursors, n,
+      seq->events, seq->eventCount, fromTick, toTick, offset, seq);
+  }
+  if(toTick <= offset) return n;
+  pass = fromTick > offset ? (int64_t)((fromTick - offset) / loopTicks) : 0;
+  for(p=0; p<LAYER_PIECES; p++, pass++){
+    passStart = offset + pass * loopTicks;
+    if(passStart >= toTick) break;
+    n = addCursor(cursors, n, seq->events, seq->eventCount,
+      fromTick > passStart ? fromTick : passStart,
+      toTick < passStart + loopTicks ? toTick : passStart + loopTicks,
+      passStart, seq);
+  }
+  return n;
+}
+
+// the loop index range is for layer 0 and only used when it doesn't loop
+void computeLoopRange(
+  struct loopRange* loop,
+  struct sequence* seq,
+  struct tempoMap* tm
+){
+  int64_t offset = layers[0].offset;
+  loop->startNs = tickToNs(tm, loopStartBeat * tm->ticksPerBeat);
+  loop->endNs = tickToNs(tm, loopEndBeat * tm->ticksPerBeat);
+  loop->first = seq == NULL ? 0 : lowerBoundTick(seq->events, seq->eventCount,
+    nsToTick(tm, loop->startNs) - offset);
+  loop->last = seq == NULL ? 0 : lowerBoundTick(seq->events, seq->eventCount,
+    nsToTick(tm, loop->endNs) - offset);
+  loopStartNs = loop->startNs;
+  loopEndNs = loop->endNs;
+}
+
+// cursors over every audible layer and every visible take run in the range.
+// fromIndex and toIndex bound layer 0 if known, -1 to search.
+int frameCursors(
+  struct cursor* cursors,
+  struct sequence** seqs,
+  double fromTick,
+  double toTick,
+  int fromIndex,
+  int toIndex
+){
+  int n = 0;
+  int count = layerCount;
+  struct layer* ly;
+  struct take* tk;
+  int visible;
+  int runCount;
+  int start, end;
+  int first;
+  int i, r;
+  for(i=0; i<count; i++){
+    ly = &layers[i];
+    if(seqs[i] == NULL || ly->muted) continue;
+    first = n;
+    if(i == 0 && ly->loopTicks == 0 && (fromIndex >= 0 || toIndex >= 0)){
+      start = fromIndex >= 0 ? fromIndex : lowerBoundTick(
+        seqs[0]->events, seqs[0]->eventCount, fromTick - ly->offset);
+      end = toIndex >= 0 ? toIndex : lowerBoundTick(
+        seqs[0]->events, seqs[0]->eventCount, toTick - ly->offset);
+      if(start < end){
+        cursors[n].at = seqs[0]->events + start;
+        cursors[n].end = seqs[0]->events + end;
+        cursors[n].base = ly->offset;
+        cursors[n].seq = seqs[0];
+        n++;
+      }
+    }
+    else{
+      n = layerCursors(cursors, n, ly, seqs[i], fromTick, toTick);
+    }
+    for(; first<n; first++) cursors[first].owner = i;
+  }
+  first = n;
+  for(i=0; i<takeCount; i++){
+    tk = takes[i];
+    visible = tk->visible;
+    runCount = tk->runCount;
+    for(r=0; r<runCount; r++){
+      start = tk->runStart[r];
+      if(start >= visible) break;
+      end = r+1 < runCount ? tk->runStart[r+1] : visible;
+      if(end > visible) end = visible;
+      n = addCursor(cursors, n,
+        tk->events + start, end - start, fromTick, toTick, 0, NULL);
+    }
+  }
+  for(; first<n; first++) cursors[first].owner = OWNER_LIVE;
+  return n;
+}
+
+// min-heap of cursor indices ordered by song tick of the next event. at the
+// same tick note offs go first, as within a sorted sequence, then the lower
+// cursor index so layer order is kept, takes come last.
+int cursorBefore(struct cursor* cursors, int a, int b){
+  int64_t ta = cursors[a].base + cursors[a].at->tick;
+  int64_t tb = cursors[b].base + cursors[b].at->tick;
+  int offA;
+  int offB;
+  if(ta != tb) return ta < tb;
+  offA = noteOffEvent(cursors[a].at);
+  offB = noteOffEvent(cursors[b].at);
+  return offA > offB || (offA == offB && a < b);
+}
+
+void siftDown(struct cursor* cursors, int* heap, int n, int i){
+  int child;
+  int tmp;
+  for(;;){
+    child = 2*i + 1;
+    if(child >= n) break;
+    if(child+1 < n && cursorBefore(cursors, heap[child+1], heap[child])) child++;
+    if(!cursorBefore(cursors, heap[child], heap[i])) break;
+    tmp = heap[i];
+    heap[i] = heap[child];
+    heap[child] = tmp;
+    i = child;
+  }
+}
+
+/** sysex output **/
+// owned by the dispatch thread. sysex messages are copied into a ring as
+// they come up and streamed out at most a cable's worth of bytes per frame,
+// so a big dump is spread over as many frames as it takes.
+
+// returns -1 if there's no room and the sysex was dropped
+int queueSysex(uint8_t* payload, uint32_t length, uint64_t when){
+  struct sysexOut* out;
+  uint32_t total = length + 1;
+  uint32_t i;
+  if(sysexPending == SYSEX_QUEUE ||
+     SYSEX_RING - (sysexRingWrite - sysexRingRead) < total){
+    fprintf(stderr, "SOUND sysex output backed up, dropping %u bytes\n", total);
+    return -1;
+  }
+  out = &sysexQueue[(sysexHead + sysexPending) % SYSEX_QUEUE];
+  out->when = when;
+  out->start = sysexRingWrite;
+  out->length = total;
+  sysexRing[sysexRingWrite++ % SYSEX_RING] = 0xf0;
+  for(i=0; i<length; i++) sysexRing[sysexRingWrite++ % SYSEX_RING] = payload[i];
+  sysexPending++;
+  sysexStreaming = 1;
+  return 0;
+}
+
+// forget queued sysex. one cut off halfway is ended with an F7 so the
+// receiver isn't left inside it.
+void dropSysex(){
+  unsigned char packetListStorage[PACKET_LIST_SIZE];
+  MIDIPacketList* packetList = (MIDIPacketList*) packetListStorage;
+  MIDIPacket* packet;
+  uint8_t eox = 0xf7;
+  uint64_t when;
+  if(sysexStarted){
+    when = voiceTime(mach_absolute_time());
+    packet = MIDIPacketListInit(packetList);
+    MIDIPacketListAdd(packetList, PACKET_LIST_SIZE, packet, when, 1, &eox);
+    MIDIReceived(outputPort, packetList);
+    sysexBusyUntilNs = when + 1000000000ULL / MIDI_WIRE_BYTES_PER_S;
+  }
+  sysexStarted = 0;
+  sysexPending = 0;
+  sysexRingRead = sysexRingWrite;
+  sysexStreaming = 0;
+}
+
+// send up to a frame's budget of queued sysex bytes due before frameEndNs
+void dispatchSysex(uint64_t frameStartNs, uint64_t frameEndNs, uint64_t frame){
+  unsigned char packetListStorage[PACKET_LIST_SIZE];
+  MIDIPacketList* packetList = (MIDIPacketList*) packetListStorage;
+  MIDIPacket* packet;
+  uint8_t chunk[SYSEX_CHUNK_MAX];
+  struct sysexOut* out;
+  uint32_t budget = frame * MIDI_WIRE_BYTES_PER_S / 1000000000;
+  uint64_t when;
+  uint32_t n;
+  uint32_t i;
+  int sent = 0;
+
+  if(sysexPending == 0) return;
+  if(budget < SYSEX_CHUNK_MIN) budget = SYSEX_CHUNK_MIN;
+  if(budget > SYSEX_CHUNK_MAX) budget = SYSEX_CHUNK_MAX;
+
+  packet = MIDIPacketListInit(packetList);
+  while(sysexPending > 0 && budget > 0){
+    out = &sysexQueue[sysexHead];
+    if(out->when >= frameEndNs) break;
+    // voice events held back by the last sysex go before the next one
+    if(!sysexStarted && livePendingCount > 0 && livePending[0].when < out->when) break;
+    n = out->length < budget ? out->length : budget;
+    for(i=0; i<n; i++) chunk[i] = sysexRing[(out->start + i) % SYSEX_RING];
+    when = voiceTime(out->when > frameStartNs ? out->when : frameStartNs);
+    packet = MIDIPacketListAdd(packetList, PACKET_LIST_SIZE, packet, when, n, chunk);
+    if(packet == NULL) break; // the rest goes next frame
+    sent = 1;
+    sysexBusyUntilNs = when + n * 1000000000ULL / MIDI_WIRE_BYTES_PER_S;
+    out->start += n;
+    out->length -= n;
+    sysexRingRead += n;
+    budget -= n;
+    sysexStarted = out->length > 0;
+    if(out->length == 0){
+      sysexHead = (sysexHead + 1) % SYSEX_QUEUE;
+      sysexPending--;
+    }
+  }
+  if(sent) MIDIReceived(outputPort, packetList);
+  sysexStreaming = sysexPending > 0;
+}
+
 // execute midi events within the range fromNs to toNs where 0 is the start
-// of the song. should consider loop position to repeat parts indefinitely.
-void dispatchFrame(struct sequence* seq, uint64_t fromNs, uint64_t toNs){
+// of the song. fromNs plays at absoluteFromNs, later song time is compressed
+// by the tempo scale. the caller splits frames at the loop end.
+// returns 1 if it stopped at a sysex. the song then waits at stallTick until
+// the sysex has streamed out, and the stallSkip events at that tick already
+// handled are skipped when it carries on.
+int dispatchFrame(
+  struct sequence** seqs,
+  struct tempoMap* tm,
+  uint64_t fromNs,
+  uint64_t toNs,
+  int fromIndex,
+  int toIndex,
+  uint64_t absoluteFromNs,
+  double scale
+){
   //fprintf(stderr, "[%llu, %llu)\n", fromNs, toNs);
   unsigned char packetListStorage[PACKET_LIST_SIZE];
   MIDIPacketList* packetList = (MIDIPacketList*) packetListStorage;
   MIDIPacket* packet;
-  int packetSize = sizeof(uint64_t) + sizeof(uint16_t) + 3;
   unsigned char midi[3];
-  int i, j;
   int midiSize;
-  int c = 0;
-
-  int eventCount = seq->eventCount;
-  struct sequencerEvent* events = seq->events;
-
-  for(i=0; i<eventCount; i++){ // get to the first event in range
-    if(events[i].atNs >= fromNs) break;
-  }
-  //printf("i = %d\n", i);
+  uint64_t atNs;
+  uint64_t when;
+  struct cursor cursors[CURSOR_MAX];
+  int heap[CURSOR_MAX];
+  struct sequencerEvent* ev;
+  struct sysexRef* ref;
+  struct sequence* seq;
+  uint32_t index;
+  int owner;
+  int64_t tick;
+  int64_t lastTick = -1;
+  int sameTick = 0;
+  int stalled = 0;
+  int heapSize;
+  int top;
+  int c;
+
+  heapSize = frameCursors(cursors, seqs,
+    nsToTick(tm, fromNs), nsToTick(tm, toNs),
+    fromIndex, toIndex);
+  for(c=0; c<heapSize; c++) heap[c] = c;
+  for(c=heapSize/2-1; c>=0; c--) siftDown(cursors, heap, heapSize, c);
 
   packet = MIDIPacketListInit(packetList);
 
-  for(j=0; i<eventCount; i++, j++){ // for each event in range
-    if(events[i].atNs >= toNs) break;
-    //printf("i=%d j=%d %u %x %u %u\n", i, j, events[i].tick, events[i].typeChan, events[i].arg1, events[i].arg2);
+  while(heapSize > 0){ // merge the cursors by song tick
+    top = heap[0];
+    ev = cursors[top].at++;
+    seq = cursors[top].seq;
+    owner = cursors[top].owner;
+    tick = cursors[top].base + ev->tick;
+    if(cursors[top].at == cursors[top].end) heap[0] = heap[--heapSize];
+    siftDown(cursors, heap, heapSize, 0);
+
+    if(tick != lastTick){
+      lastTick = tick;
+      sameTick = 0;
+    }
+    sameTick++;
+    if(tick != stallTick) stallSkip = 0;
+    if(stallSkip > 0){
+      stallSkip--;
+      continue;
+    }
+
+    atNs = tickToNs(tm, tick);
+    when = atNs > fromNs ? absoluteFromNs + (atNs - fromNs) / scale : absoluteFromNs;
+
+    if(ev->typeChan == 0xf0){
+      // a restored arena may be missing or shorter than the events expect
+      index = ev->arg1 << 8 | ev->arg2;
+      if(seq == NULL || seq->arena == NULL || index >= seq->sysexCount) continue;
+      ref = (struct sysexRef*)seq->arena + index;
+      if(ref->offset > seq->arenaSize || ref->length > seq->arenaSize - ref->offset) continue;
+      if(queueSysex(seq->arena + ref->offset, ref->length, when) < 0) continue;
+      stallTick = tick;
+      stallSkip = sameTick;
+      stalled = 1;
+      break;
+    }
 
-    c++;
-    midi[0] = events[i].typeChan;
-    midi[1] = events[i].arg1;
-    midi[2] = events[i].arg2;
+    midi[0] = ev->typeChan;
+    midi[1] = ev->arg1;
+    midi[2] = ev->arg2;
+    when = voiceTime(when);
     midiSize = 3;
     if((midi[0] & 0xf0) == 0xc0 || (midi[0] & 0xf0) == 0xd0) midiSize = 2;
-    if((midi[0] & 0xf0) != 0x80){
-      //fprintf(stderr, "%llu %02x %02x %02x\n", events[i].atNs, midi[0], midi[1], midi[2]);
-    }
     if((midi[0] & 0xf0) == 0x90 && midi[2] > 0){
-      rememberNoteOn(midi[0] & 0x0f, midi[1]);
+      rememberNoteOn(midi[0] & 0x0f, midi[1], owner);
     }
     if((midi[0] & 0xf0) == 0x80 || ((midi[0] & 0xf0) == 0x90 && midi[2] == 0)){
       forgetNoteOn(midi[0] & 0x0f, midi[1]);
@@ -599,101 +2188,196 @@ void dispatchFrame(struct sequence* seq, uint64_t fromNs, uint64_t toNs){
       packetList,
       PACKET_LIST_SIZE,
       packet, 
-      events[i].atNs + absoluteSongStartNs,
+      when,
       midiSize,
       midi
     );
-    if(packet == NULL){
-      fprintf(stderr, "** SOUND unable to MIDIPacketListAdd\n");
-      exit(-1);
+    if(packet == NULL){ // list full, send what we have and start another
+      MIDIReceived(outputPort, packetList);
+      packet = MIDIPacketListInit(packetList);
+      packet = MIDIPacketListAdd(packetList, PACKET_LIST_SIZE, packet, when, midiSize, midi);
     }
-    //printf("still ok\n");
   }
 
-  //printf("output\n");
   MIDIReceived(outputPort, packetList);
-  //printf("hmm\n");
+  return stalled;
 }
 
-// a frame is a 20ms chunk of time. we play 20ms ahead of time, sleep for
-// 20ms, play 20ms of events, and sleep for ~20ms depending on overshot.
+// keep the lookahead at 4 times the worst recent wake up delay. the peak
+// decays by 1/64 per frame, so on a quiet host the lookahead slowly shrinks.
+void adaptLookahead(uint64_t lateNs){
+  uint64_t target;
+  wakeLatePeakNs -= wakeLatePeakNs / 64;
+  if(lateNs > wakeLatePeakNs) wakeLatePeakNs = lateNs;
+  target = 4 * wakeLatePeakNs;
+  if(target < adaptMinNs) target = adaptMinNs;
+  if(target > adaptMaxNs) target = adaptMaxNs;
+  frameNs = target;
+}
+
+// a frame is a chunk of time as long as the lookahead, 20ms by default. we
+// play a frame ahead of time, sleep for a frame, play a frame of events, and
+// sleep for about a frame depending on overshot. with a tempo scale other
+// than 1 a frame covers frame * scale of song time. the lookahead may change
+// between frames.
+// a frame is cut into spans at the loop end, as many as it takes.
+// waking up more than a frame late leaves a gap in the song rather than
+// ending the server, and the lateness is fed to the adaptive lookahead.
 // ASSUMPTION mach_absolute_time returns nanoseconds, that is num=denom=1
 void* sleepWakeAndDispatchFrame(){
   uint64_t sleepTargetNs;
   uint64_t currentNs;
-  uint64_t overshot;
-  struct sequence* sequenceSnap;
-  struct sequence* sequenceSnapPrev = NULL;
+  uint64_t songFrameNs;
+  uint64_t remainingNs;
+  uint64_t spanNs;
+  uint64_t spanAbsNs;
+  uint64_t lateNs;
+  uint64_t frame = frameNs;
+  double scale;
+  int fromIndex;
+  int toIndex;
+  struct sequence* sequenceSnap[LAYER_MAX];
+  struct sequence* sequenceSnapPrev[LAYER_MAX];
+  int i;
+  struct tempoMap* tempoSnap;
+  struct tempoMap* tempoSnapPrev = NULL;
+  struct loopRange loop;
+  int looping;
+  int loopDirty = 1;
+  int loopGen = loopGeneration;
+
+  for(i=0; i<LAYER_MAX; i++){
+    sequenceSnapPrev[i] = layers[i].seq;
+  }
 
   currentNs = mach_absolute_time();
-  absolutePlayHeadNs = (currentNs-currentNs%FRAME_SIZE_NS) + FRAME_SIZE_NS;
-  absoluteLeadingEdgeNs = absolutePlayHeadNs + FRAME_SIZE_NS;
-  absoluteSongStartNs = absolutePlayHeadNs - songNs;
+  absolutePlayHeadNs = (currentNs-currentNs%frame) + frame;
 
   for(;;){
-    sequenceSnap = currentSequence;
-    if(sequenceSnapPrev && sequenceSnapPrev != sequenceSnap){
-      trashSequence(sequenceSnapPrev);
+    frame = frameNs;
+    absoluteLeadingEdgeNs = absolutePlayHeadNs + frame;
+
+    tempoSnap = currentTempoMap;
+    if(tempoSnapPrev && tempoSnapPrev != tempoSnap){
+      rebaseSong(tempoSnapPrev, tempoSnap);
+      trashTempoMap(tempoSnapPrev);
+      loopDirty = 1;
+    }
+    tempoSnapPrev = tempoSnap;
+
+    for(i=0; i<LAYER_MAX; i++){
+      sequenceSnap[i] = layers[i].seq;
+      if(sequenceSnapPrev[i] != sequenceSnap[i]){
+        if(sequenceSnapPrev[i]) trashSequence(sequenceSnapPrev[i]);
+        if(i == 0) loopDirty = 1;
+      }
+      sequenceSnapPrev[i] = sequenceSnap[i];
     }
-    sequenceSnapPrev = sequenceSnap;
+
+    if(loopGen != loopGeneration){
+      loopGen = loopGeneration;
+      loopDirty = 1;
+    }
+    if(loopDirty && loopInitialized){
+      computeLoopRange(&loop, sequenceSnap[0], tempoSnap);
+      loopDirty = 0;
+    }
+    looping = loopFlag && loopInitialized && loop.endNs >= loop.startNs + LOOP_MIN_NS;
+
+    scale = tempoScale;
+    songFrameNs = frame * scale;
 
     if(playFlag == 0){
       onlineSeekFlag = 0;
+      cutLayerMask = 0;
+      stallSkip = 0;
+      dropSysex();
+      collectLive(); // EXPRESS notes still in the inbox are cut too
       killAll();
+      commitTakes();
+      publishPlayhead();
       return NULL;
     }
     if(onlineSeekFlag == 1){
       killAll();
+      commitTakes();
+      dropSysex();
+      stallSkip = 0;
       songNs = onlineSeekTargetNs;
       absolutePlayHeadNs = currentNs;
-      absoluteLeadingEdgeNs = absolutePlayHeadNs + FRAME_SIZE_NS;
-      absoluteSongStartNs = absolutePlayHeadNs - songNs;
+      absoluteLeadingEdgeNs = absolutePlayHeadNs + frame;
       onlineSeekFlag = 0;
     }
     if(cutAllFlag){
+      dropLive(); // before the kill, so EXPRESS notes in the inbox are cut
       killAll();
+      dropSysex();
       cutAllFlag = 0;
     }
-    if(loopFlag && songNs > loopEndNs){
+    if(cutLayerMask){
+      killOwned(__sync_fetch_and_and(&cutLayerMask, 0));
+    }
+    if(looping && songNs > loop.endNs){
       killAll();
-      songNs = loopStartNs;
+      commitTakes();
+      songNs = loop.startNs;
       absolutePlayHeadNs = currentNs;
-      absoluteLeadingEdgeNs = absolutePlayHeadNs + FRAME_SIZE_NS;
-      absoluteSongStartNs = absolutePlayHeadNs - songNs;
-    }
-
-    if(loopFlag && songNs + FRAME_SIZE_NS > loopEndNs){
-      overshot = songNs + FRAME_SIZE_NS - loopEndNs;
-      dispatchFrame(sequenceSnap, songNs, loopEndNs + 1); 
-      /*fprintf(stderr, "dispatch frame [%llu, %llu] [%llu, %llu]\n",
-        songNs, loopEndNs,
-        absolutePlayHeadNs, absoluteLeadingEdgeNs
-      );*/
-      absolutePlayHeadNs += loopEndNs - songNs;
-      absoluteSongStartNs = absolutePlayHeadNs - loopStartNs;
-      dispatchFrame(sequenceSnap, loopStartNs, loopStartNs + overshot);
-      /*fprintf(stderr, "dispatch frame [%llu, %llu) [%llu, %llu)\n",
-        loopStartNs, loopStartNs + overshot,
-        absolutePlayHeadNs, absoluteLeadingEdgeNs
-      );*/
-      songNs = loopStartNs + overshot;
+      absoluteLeadingEdgeNs = absolutePlayHeadNs + frame;
     }
-    else{
-      dispatchFrame(sequenceSnap, songNs, songNs + FRAME_SIZE_NS);
-      /*fprintf(stderr, "dispatch frame [%llu, %llu) [%llu, %llu)\n",
-        songNs, songNs+FRAME_SIZE_NS,
-        absolutePlayHeadNs, absoluteLeadingEdgeNs
-      );*/
-      songNs += FRAME_SIZE_NS; // looping wrapping...
+
+    // the song doesn't move while a sysex it stopped at is on the wire
+    remainingNs = sysexPending > 0 || sysexBusyUntilNs > absolutePlayHeadNs ? 0 : songFrameNs;
+    publishFrameClock(absolutePlayHeadNs, songNs, remainingNs > 0 ? scale : 0);
+
+    spanAbsNs = absolutePlayHeadNs;
+    while(remainingNs > 0){
+      spanNs = remainingNs;
+      fromIndex = -1;
+      toIndex = -1;
+      if(looping){
+        if(songNs == loop.startNs) fromIndex = loop.first;
+        if(songNs + spanNs >= loop.endNs){
+          spanNs = loop.endNs - songNs;
+          toIndex = loop.last;
+        }
+      }
+      if(dispatchFrame(sequenceSnap, tempoSnap,
+        songNs, songNs + spanNs,
+        fromIndex, toIndex,
+        spanAbsNs, scale)){
+        // carry on from half a tick before the sysex, ticks are whole
+        songNs = stallTick > 0 ? tickToNs(tempoSnap, stallTick - 0.5) : 0;
+        break;
+      }
+      songNs += spanNs;
+      spanAbsNs += spanNs / scale;
+      remainingNs -= spanNs;
+      if(looping && songNs >= loop.endNs){
+        songNs = loop.startNs;
+        commitTakes();
+      }
+    }
+    dispatchSysex(absolutePlayHeadNs, absolutePlayHeadNs + frame, frame);
+    dispatchLive(absolutePlayHeadNs + frame);
+    publishPlayhead();
+    if(resumePending){
+      resumePending = 0;
+      saved->restartLatencyNs = mach_absolute_time() - startedNs;
+      fprintf(stderr, "SOUND resumed, first frame %llu us after start\n",
+        (unsigned long long)(saved->restartLatencyNs / 1000));
     }
     sleepTargetNs = absolutePlayHeadNs - currentNs;
-    absolutePlayHeadNs += FRAME_SIZE_NS;
-    absoluteLeadingEdgeNs += FRAME_SIZE_NS;
     usleep(sleepTargetNs / 1000);
     currentNs = mach_absolute_time();
-    if(currentNs > absolutePlayHeadNs){ // over sleep
-      fprintf(stderr, "SOUND over slept! game over man!\n");
-      exit(-1);
+    lateNs = currentNs > absolutePlayHeadNs ? currentNs - absolutePlayHeadNs : 0;
+    if(adaptFlag) adaptLookahead(lateNs);
+    if(lateNs > frame){ // over slept, the song carries on a frame from now
+      fprintf(stderr, "SOUND over slept by %llu us, resyncing\n",
+        (unsigned long long)(lateNs / 1000));
+      absolutePlayHeadNs = currentNs + frame;
+    }
+    else{
+      absolutePlayHeadNs += frame;
     }
   }
 }
@@ -739,11 +2423,15 @@ void* garbageWorker(){
     pthread_cond_wait(&garbageSignal, &garbageMutex);
     for(i=0; i<GARBAGE_SIZE; i++){
       if(garbage[i] != NULL){
-        free(garbage[i]->events);
-        free(garbage[i]->tempoChanges);
-        free(garbage[i]);
+        freeSequence(garbage[i]);
         garbage[i] = NULL;
       }
+      if(tempoGarbage[i] != NULL){
+        while(captureBusy) usleep(100);
+        free(tempoGarbage[i]->changes);
+        free(tempoGarbage[i]);
+        tempoGarbage[i] = NULL;
+      }
     }
   }
 }
@@ -759,56 +2447,109 @@ void initGarbage(){
   int i;
   for(i=0; i<GARBAGE_SIZE; i++){
     garbage[i] = NULL;
+    tempoGarbage[i] = NULL;
   }
 }
 
 void initNullSequence(){
   struct sequence* seq = malloc(sizeof(struct sequence));
+  struct tempoMap* tm = malloc(sizeof(struct tempoMap));
   seq->eventCount = 0;
-  seq->tempoChangeCount = 0;
   seq->events = NULL;
-  seq->tempoChanges = NULL;
-  currentSequence = seq;
+  seq->sysexCount = 0;
+  seq->arenaSize = 0;
+  seq->arena = NULL;
+  tm->ticksPerBeat = ticksPerBeat;
+  tm->count = 0;
+  tm->changes = NULL;
+  layers[0].seq = seq;
+  currentTempoMap = tm;
 }
 
 
-void executeMidi(int type, int channel, int arg1, int arg2){
-  uint64_t now = mach_absolute_time();
-  unsigned char packetListStorage[50];
-  MIDIPacketList* packetList = (MIDIPacketList*) packetListStorage;
-  MIDIPacket* packet;
-  unsigned char midi[3];
-  int midiSize;
-  if(playFlag == 1) return;
-  packet = MIDIPacketListInit(packetList);
-  midi[0] = type << 4 | channel;
-  midi[1] = arg1;
-  midi[2] = arg2;
-  midiSize = 3;
-  if((midi[0] & 0xf0) == 0xc0 || (midi[0] & 0xf0) == 0xd0) midiSize = 2;
-  if((midi[0] & 0xf0) != 0x80){
-    //fprintf(stderr, "%llu %02x %02x %02x\n", now, midi[0], midi[1], midi[2]);
-  }
-  if((midi[0] & 0xf0) == 0x90 && midi[2] > 0){
-    rememberNoteOn(midi[0] & 0x0f, midi[1]);
+int validVoice(int type, int channel, int arg1, int arg2){
+  return type >= 8 && type <= 14 && channel >= 0 && channel <= 15 &&
+    arg1 >= 0 && arg1 <= 127 && arg2 >= 0 && arg2 <= 127;
+}
+
+void executeMidi(uint64_t when, int type, int channel, int arg1, int arg2, int trace){
+  if(scheduleLive(when, type << 4 | channel, arg1, arg2, 0, trace) < 0){
+    fprintf(stderr, "SOUND live inbox full, dropping event\n");
   }
-  if((midi[0] & 0xf0) == 0x80 || ((midi[0] & 0xf0) == 0x90 && midi[2] == 0)){
-    forgetNoteOn(midi[0] & 0x0f, midi[1]);
+}
+
+// args is a list of "type channel arg1 arg2". the events are sent right away
+// from this thread, ahead of anything already dispatched, and the thread
+// that owns the on-note list is told about them afterwards. while a sysex is
+// being streamed they are queued like EXECUTE instead. returns the
+// number of events, 0 if the line is invalid.
+int expressBatch(char* args, int execute, int trace){
+  unsigned char packetListStorage[PACKET_LIST_SIZE];
+  MIDIPacketList* packetList = (MIDIPacketList*) packetListStorage;
+  MIDIPacket* packet = MIDIPacketListInit(packetList);
+  uint64_t now = mach_absolute_time();
+  int held = sysexStreaming || now < sysexBusyUntilNs;
+  uint8_t midi[3];
+  int m[4];
+  int used;
+  int count = 0;
+  for(;;){
+    while(*args == ' ') args++;
+    if(*args == 0) break;
+    if(sscanf(args, "%d %d %d %d%n", &m[0], &m[1], &m[2], &m[3], &used) < 4) return 0;
+    if(!validVoice(m[0], m[1], m[2], m[3])) return 0;
+    if(execute && held){ // queued behind the sysex being streamed
+      if(scheduleLive(now, m[0] << 4 | m[1], m[2], m[3], 0, count == 0 ? trace : 0) < 0){
+        fprintf(stderr, "SOUND live inbox full, dropping event\n");
+      }
+    }
+    else if(execute){
+      midi[0] = m[0] << 4 | m[1];
+      midi[1] = m[2];
+      midi[2] = m[3];
+      packet = MIDIPacketListAdd(
+        packetList, PACKET_LIST_SIZE, packet, now, voiceMessageSize(midi[0]), midi
+      );
+      if(packet == NULL){
+        fprintf(stderr, "** SOUND 'express' unable to MIDIPacketListAdd\n");
+        exit(-1);
+      }
+      if(scheduleLive(now, midi[0], midi[1], midi[2], 1, 0) < 0){
+        fprintf(stderr, "SOUND live inbox full, express event not tracked\n");
+      }
+    }
+    args += used;
+    count++;
   }
-  packet = MIDIPacketListAdd(
-    packetList,
-    50,
-    packet, 
-    now,
-    midiSize,
-    midi
-  );
-  if(packet == NULL){
-    fprintf(stderr, "** SOUND 'execute' unable to MIDIPacketListAdd\n");
-    exit(-1);
+  if(execute && !held){
+    MIDIReceived(outputPort, packetList);
+    if(trace) finishTrace(trace, mach_absolute_time());
   }
+  return count;
+}
 
-  MIDIReceived(outputPort, packetList);
+// args is a list of "delay type channel arg1 arg2" with delay in us. the
+// whole line is checked before anything is scheduled. returns the number of
+// events, 0 if the line is invalid. a trace goes with the first event.
+int scheduleBatch(char* args, uint64_t baseNs, int execute, int trace){
+  int delay;
+  int midi[4];
+  int used;
+  int count = 0;
+  for(;;){
+    while(*args == ' ') args++;
+    if(*args == 0) break;
+    if(sscanf(args, "%d %d %d %d %d%n",
+      &delay, &midi[0], &midi[1], &midi[2], &midi[3], &used) < 5) return 0;
+    if(delay < 0 || !validVoice(midi[0], midi[1], midi[2], midi[3])) return 0;
+    if(execute){
+      executeMidi(baseNs + delay*1000ULL, midi[0], midi[1], midi[2], midi[3],
+        count == 0 ? trace : 0);
+    }
+    args += used;
+    count++;
+  }
+  return count;
 }
 
 void stdinWorker(){
@@ -822,7 +2563,12 @@ void stdinWorker(){
   int result;
   double loop0;
   double loop1;
+  double scale;
   int midi[4];
+  uint64_t nowNs;
+  uint64_t stamps[3];
+  struct sequence* seq;
+  struct tempoMap* tm;
 
   fgets(buf, INBUF_SIZE, stdin);
   if(ferror(stdin)){
@@ -831,6 +2577,7 @@ void stdinWorker(){
   }
   if(feof(stdin)){
     fprintf(stderr, "SOUND stdin is EOF. Terminating\n");
+    unlinkSegments(); // a clean shutdown, nothing to resume
     exit(0);
   }
 
@@ -846,11 +2593,115 @@ void stdinWorker(){
       fprintf(stderr, "** SOUND invalid LOAD command (%s)\n", buf);
       exit(-1);
     }
-    currentSequence = loadData(arg1, arg2);
-    emptyTrash();
+    // both dumps are read before either is swapped in
+    seq = loadSequence(arg1);
+    tm = seq ? loadTempoMap(arg2) : NULL;
+    if(tm == NULL){
+      if(seq) freeSequence(seq);
+      fprintf(stderr, "** SOUND LOAD rejected, keeping the current sequence\n");
+    }
+    else{
+      swapTempoMap(tm);
+      swapLayer(0, seq);
+    }
+  }
+  else if(strcmp(command, "load-layer")==0){
+    result = sscanf(buf, "%s %d %s", command, &number, arg1);
+    if(result < 3){
+      fprintf(stderr, "** SOUND invalid LOAD_LAYER command (%s)\n", buf);
+    }
+    else if(validLayer(number)){
+      seq = loadSequence(arg1);
+      if(seq == NULL){
+        fprintf(stderr, "** SOUND LOAD_LAYER rejected, keeping layer %d\n", number);
+      }
+      else{
+        swapLayer(number, seq);
+      }
+    }
+  }
+  else if(strcmp(command, "clear-layer")==0){
+    result = sscanf(buf, "%s %d", command, &number);
+    if(result < 2){
+      fprintf(stderr, "** SOUND invalid CLEAR_LAYER command (%s)\n", buf);
+    }
+    else if(validLayer(number)){
+      if(playFlag) __sync_fetch_and_or(&cutLayerMask, 1u << number);
+      swapLayer(number, NULL);
+    }
+  }
+  else if(strcmp(command, "layer-offset")==0){
+    result = sscanf(buf, "%s %d %d", command, &number, &numerator);
+    if(result < 3){
+      fprintf(stderr, "** SOUND invalid LAYER_OFFSET command (%s)\n", buf);
+    }
+    else if(validLayer(number)){
+      layers[number].offset = numerator;
+      saved->layers[number].offset = numerator;
+      loopGeneration++;
+    }
+  }
+  else if(strcmp(command, "layer-loop")==0){
+    result = sscanf(buf, "%s %d %d", command, &number, &numerator);
+    if(result < 3 || numerator < 0){
+      fprintf(stderr, "** SOUND invalid LAYER_LOOP command (%s)\n", buf);
+    }
+    else if(validLayer(number)){
+      layers[number].loopTicks = numerator;
+      saved->layers[number].loopTicks = numerator;
+      loopGeneration++;
+    }
+  }
+  else if(strcmp(command, "mute-layer")==0){
+    result = sscanf(buf, "%s %d", command, &number);
+    if(result < 2){
+      fprintf(stderr, "** SOUND invalid MUTE_LAYER command (%s)\n", buf);
+    }
+    else if(validLayer(number)){
+      layers[number].muted = 1;
+      saved->layers[number].muted = 1;
+      if(playFlag) __sync_fetch_and_or(&cutLayerMask, 1u << number);
+    }
+  }
+  else if(strcmp(command, "unmute-layer")==0){
+    result = sscanf(buf, "%s %d", command, &number);
+    if(result < 2){
+      fprintf(stderr, "** SOUND invalid UNMUTE_LAYER command (%s)\n", buf);
+    }
+    else if(validLayer(number)){
+      layers[number].muted = 0;
+      saved->layers[number].muted = 0;
+    }
+  }
+  else if(strcmp(command, "tempo")==0){
+    result = sscanf(buf, "%s %s", command, arg1);
+    if(result < 2){
+      fprintf(stderr, "** SOUND invalid TEMPO command (%s)\n", buf);
+    }
+    else{
+      tm = loadTempoMap(arg1);
+      if(tm == NULL){
+        fprintf(stderr, "** SOUND TEMPO rejected, keeping the current tempo map\n");
+      }
+      else{
+        swapTempoMap(tm);
+      }
+    }
+  }
+  else if(strcmp(command, "tempo-scale")==0){
+    result = sscanf(buf, "%s %lf", command, &scale);
+    if(result < 2 || scale <= 0){
+      fprintf(stderr, "** SOUND invalid TEMPO_SCALE command (%s)\n", buf);
+    }
+    else{
+      tempoScale = scale;
+      saved->tempoScale = scale;
+      if(playFlag == 0) publishPlayhead();
+    }
   }
   else if(strcmp(command, "play")==0){
     if(playFlag == 0){
+      joinLiveThread();
       playFlag = 1;
       spawnDispatchThread();
     }
@@ -862,6 +2713,7 @@ void stdinWorker(){
     if(playFlag == 1){
       playFlag = 0;
       joinDispatchThread();
+      spawnLiveThread();
     }
     else{
       fprintf(stderr, "SOUND stop ignored, playFlag=%d\n", playFlag);
@@ -884,15 +2736,40 @@ void stdinWorker(){
     abort();
   }
   else if(strcmp(command, "exit")==0){
+    unlinkSegments();
     interrupt(0);
   }
   else if(strcmp(command, "cut-all")==0){
-    if(playFlag == 0){
-      killAll();
+    allNotesOff(); // now, the tracked notes are cut at the next frame
+    cutAllFlag = 1;
+    usleep(frameNs/1000);
+  }
+  else if(strcmp(command, "lookahead")==0){
+    result = sscanf(buf, "%s %d", command, &number);
+    if(result < 2 || number*1000ULL < MIN_FRAME_NS || number*1000ULL > MAX_FRAME_NS){
+      fprintf(stderr, "** SOUND invalid LOOKAHEAD command (%s)\n", buf);
+    }
+    else{
+      adaptFlag = 0;
+      frameNs = number*1000ULL;
+      saved->adaptFlag = 0;
+      saved->frameNs = frameNs;
+    }
+  }
+  else if(strcmp(command, "adapt-lookahead")==0){
+    result = sscanf(buf, "%s %d %d", command, &number, &numerator);
+    if(result < 3 || number > numerator ||
+       number*1000ULL < MIN_FRAME_NS || numerator*1000ULL > MAX_FRAME_NS){
+      fprintf(stderr, "** SOUND invalid ADAPT_LOOKAHEAD command (%s)\n", buf);
     }
     else{
-      cutAllFlag = 1;
-      usleep(FRAME_SIZE_NS/1000);
+      adaptMinNs = number*1000ULL;
+      adaptMaxNs = numerator*1000ULL;
+      wakeLatePeakNs = 0;
+      adaptFlag = 1;
+      saved->adaptMinNs = adaptMinNs;
+      saved->adaptMaxNs = adaptMaxNs;
+      saved->adaptFlag = 1;
     }
   }
   else if(strcmp(command, "set-loop")==0){
@@ -910,10 +2787,12 @@ void stdinWorker(){
     }
     else{
       loopFlag = 1;
+      saved->loopFlag = 1;
     }
   }
   else if(strcmp(command, "disable-loop")==0){
     loopFlag = 0;
+    saved->loopFlag = 0;
   }
   else if(strcmp(command, "ticks-per-beat")==0){
     result = sscanf(buf, "%s %d", command, &number);
@@ -924,12 +2803,8 @@ void stdinWorker(){
       fprintf(stderr, "** SOUND ignoring setting ticks per beat to %d\n", number);
     }
     else{
-      if(playFlag){
-        fprintf(stderr, "SOUND not changing ticks per beat while playing\n");
-      }
-      else{
-        ticksPerBeat = number;
-      }
+      ticksPerBeat = number;
+      swapTempoMap(retimeTempoMap(currentTempoMap, number));
     }
   }
   else if(strcmp(command, "tell")==0){
@@ -942,26 +2817,208 @@ void stdinWorker(){
       command,
       &midi[0], &midi[1], &midi[2], &midi[3]
     );
-    if(result < 5){
+    if(result < 5 || !validVoice(midi[0], midi[1], midi[2], midi[3])){
       fprintf(stderr, "** SOUND invalid EXECUTE command (%s)\n", buf);
     }
+    else if(playFlag == 0){ // nothing to mix with, out now like EXPRESS
+      nowNs = mach_absolute_time();
+      if(expressBatch(buf + strlen(command), 1, claimTrace(nowNs)) != 1){
+        fprintf(stderr, "** SOUND invalid EXECUTE command (%s)\n", buf);
+      }
+    }
+    else{
+      nowNs = mach_absolute_time();
+      executeMidi(nowNs + frameNs, midi[0], midi[1], midi[2], midi[3],
+        claimTrace(nowNs));
+    }
+  }
+  else if(strcmp(command, "schedule")==0){
+    // the batch plays one lookahead after it arrives, so every event in it is
+    // sent ahead of time and the spacing between them is exact
+    nowNs = mach_absolute_time();
+    if(scheduleBatch(buf + strlen(command), nowNs + frameNs, 0, 0) == 0){
+      fprintf(stderr, "** SOUND invalid SCHEDULE command (%s)\n", buf);
+    }
+    else{
+      scheduleBatch(buf + strlen(command), nowNs + frameNs, 1, claimTrace(nowNs));
+    }
+  }
+  else if(strcmp(command, "express")==0){
+    nowNs = mach_absolute_time();
+    if(expressBatch(buf + strlen(command), 0, 0) == 0){
+      fprintf(stderr, "** SOUND invalid EXPRESS command (%s)\n", buf);
+    }
+    else{
+      expressBatch(buf + strlen(command), 1, claimTrace(nowNs));
+    }
+  }
+  else if(strcmp(command, "trace")==0){
+    result = sscanf(buf, "%s %d %" SCNu64 " %" SCNu64 " %" SCNu64,
+      command, &number, &stamps[0], &stamps[1], &stamps[2]);
+    if(result < 5){
+      fprintf(stderr, "** SOUND invalid TRACE command (%s)\n", buf);
+    }
+    else{
+      memset(&armedTrace, 0, sizeof(armedTrace));
+      armedTrace.id = number;
+      armedTrace.stamps[HOP_VIDEO] = stamps[0];
+      armedTrace.stamps[HOP_CORE_IN] = stamps[1];
+      armedTrace.stamps[HOP_CORE_OUT] = stamps[2];
+      traceArmed = 1;
+    }
+  }
+  else if(strcmp(command, "trace-dump")==0){
+    result = sscanf(buf, "%s %s", command, arg1);
+    if(result < 2){
+      fprintf(stderr, "** SOUND invalid TRACE_DUMP command (%s)\n", buf);
+    }
+    else{
+      dumpTraces(arg1);
+    }
+  }
+  else if(strcmp(command, "trace-histogram")==0){
+    result = sscanf(buf, "%s %s", command, arg1);
+    if(result < 2){
+      fprintf(stderr, "** SOUND invalid TRACE_HISTOGRAM command (%s)\n", buf);
+    }
     else{
-      executeMidi(midi[0], midi[1], midi[2], midi[3]);
+      dumpTraceHistogram(arg1);
     }
   }
+  else if(strcmp(command, "trace-clear")==0){
+    traceCleared = traceWrite;
+  }
   else if(strcmp(command, "enable-capture")==0){
+    if(captureFlag == 0){
+      recordingTake = newTake();
+      if(recordingTake) captureFlag = 1;
+    }
   }
   else if(strcmp(command, "disable-capture")==0){
+    captureFlag = 0;
+    if(playFlag == 0) commitTakes();
   }
   else if(strcmp(command, "capture")==0){
+    dumpCapture();
+  }
+  else if(strcmp(command, "clear-capture")==0){
+    if(playFlag){
+      fprintf(stderr, "SOUND not clearing takes while playing\n");
+    }
+    else{
+      clearTakes();
+    }
   }
   else{
     fprintf(stderr, "SOUND unrecognized command (%s)\n", buf);
   }
 }
 
+// map the state segment. when resuming and it holds state left by an
+// earlier server with the same layout, take it over, including the loaded
+// sequences. otherwise start from scratch.
+void restoreState(int resume){
+  char name[SHM_NAME_SIZE];
+  char suffix[8];
+  struct segmentHeader header;
+  struct sequence* seq;
+  struct tempoMap* tm;
+  void* data;
+  int i;
+
+  segmentName(name, "st");
+  saved = mapShared(name, STATE_SHM_SIZE);
+  if(!resume || saved->magic != STATE_MAGIC || saved->version != STATE_VERSION){
+    memset(saved, 0, sizeof(struct savedState));
+    saved->ticksPerBeat = ticksPerBeat;
+    saved->tempoScale = tempoScale;
+    saved->frameNs = frameNs;
+    saved->version = STATE_VERSION;
+    __sync_synchronize();
+    saved->magic = STATE_MAGIC;
+    return;
+  }
+
+  fprintf(stderr, "SOUND restoring state left by previous server\n");
+  ticksPerBeat = saved->ticksPerBeat;
+  tempoScale = saved->tempoScale > 0 ? saved->tempoScale : 1.0;
+  if(saved->frameNs >= MIN_FRAME_NS && saved->frameNs <= MAX_FRAME_NS){
+    frameNs = saved->frameNs;
+  }
+  if(saved->adaptFlag &&
+     saved->adaptMinNs >= MIN_FRAME_NS && saved->adaptMaxNs <= MAX_FRAME_NS &&
+     saved->adaptMinNs <= saved->adaptMaxNs){
+    adaptMinNs = saved->adaptMinNs;
+    adaptMaxNs = saved->adaptMaxNs;
+    adaptFlag = 1;
+  }
+
+  segmentName(name, "tm");
+  data = readSegment(name, &header, sizeof(struct tempoChange));
+  tm = currentTempoMap;
+  tm->ticksPerBeat = ticksPerBeat;
+  if(data){
+    free(tm->changes);
+    tm->ticksPerBeat = header.aux;
+    tm->count = header.count;
+    tm->changes = data;
+  }
+
+  for(i=0; i<LAYER_MAX; i++){
+    if(!saved->layers[i].present) continue;
+    snprintf(suffix, 8, "l%d", i);
+    segmentName(name, suffix);
+    data = readSegment(name, &header, sizeof(struct sequencerEvent));
+    if(data == NULL){
+      fprintf(stderr, "** SOUND layer %d is missing its segment\n", i);
+      saved->layers[i].present = 0;
+      continue;
+    }
+    seq = malloc(sizeof(struct sequence));
+    if(seq == NULL){
+      fprintf(stderr, "** SOUND failed to malloc sequence\n");
+      exit(-3);
+    }
+    seq->eventCount = header.count;
+    seq->events = data;
+    snprintf(suffix, 8, "x%d", i);
+    segmentName(name, suffix);
+    seq->arena = readSegment(name, &header, 1);
+    seq->arenaSize = seq->arena ? header.count : 0;
+    seq->sysexCount = seq->arena ? header.aux : 0;
+    if(seq->arenaSize < seq->sysexCount * sizeof(struct sysexRef)){
+      fprintf(stderr, "** SOUND layer %d has a bad sysex arena\n", i);
+      seq->sysexCount = 0;
+    }
+    if(layers[i].seq){
+      freeSequence(layers[i].seq);
+    }
+    layers[i].seq = seq;
+    layers[i].offset = saved->layers[i].offset;
+    layers[i].loopTicks = saved->layers[i].loopTicks;
+    layers[i].muted = saved->layers[i].muted;
+    if(i >= layerCount) layerCount = i + 1;
+  }
+
+  if(saved->loopInitialized){
+    setLoopEndpoints(saved->loopStartBeat, saved->loopEndBeat);
+  }
+  loopFlag = saved->loopFlag;
+  songNs = saved->songNs;
+  resumePending = saved->playing;
+}
+
 int main(int argc, char* argv[]){
+  int resume = 0;
+  startedNs = mach_absolute_time();
   fprintf(stderr, "SOUND Hello World\n");
+
+  if(argc > 1 && strcmp(argv[1], "--resume") == 0){
+    resume = 1;
+    argc--;
+    argv++;
+  }
+  if(argc > 1) shmBase = argv[1];
   
   if(setupCoreMidi()){
     fprintf(stderr, "SOUND CoreMidi setup failed.\n");
@@ -969,12 +3026,23 @@ int main(int argc, char* argv[]){
   }
 
   initNullSequence();
+  restoreState(resume);
+  setupPlayhead();
   initPlayingNotes();
   initGarbage();
   spawnGarbageThread();
 
   signal(SIGINT, interrupt);
 
+  if(resumePending){
+    allNotesOff();
+    playFlag = 1;
+    spawnDispatchThread();
+  }
+  else{
+    spawnLiveThread();
+  }
+
   for(;;) stdinWorker();
   fprintf(stderr, "SOUND impossible -2\n");
   return -2;
@@ -1,5 +1,7 @@
 #import <Cocoa/Cocoa.h>
 #import <Carbon/Carbon.h>
+#import <CoreText/CoreText.h>
+#import <mach/mach_time.h>
 #import <stdio.h>
 #import <unistd.h>
 #import <stdlib.h>
@@ -10,6 +12,55 @@ unsigned char* paintBuffer = NULL;
 size_t paintBufferSize = 0;
 int paintBufferPtr = 0;
 
+// pointer motion and wheel are coalesced and sent once per display frame as
+// fixed size binary records. a record starts with a byte that can't begin a
+// text event line so both kinds can share the event pipe.
+#define RECORD_MARK 0x01
+#define RECORD_SIZE 10
+#define MOTION_FRAME_S (1.0/60)
+
+// text is drawn from a cache of glyphs rasterized once into a gray atlas.
+// a label is put together from atlas rows and painted with one masked fill.
+// glyphs are rasterized at the backing scale, sizes in the atlas are pixels.
+#define TEXT_FONT "Menlo"
+#define TEXT_POINTS 12
+#define ATLAS_SIZE 1024
+#define GLYPH_CACHE_SIZE 2048 // power of 2
+#define LABEL_MAX_WIDTH 4096
+
+struct glyphSlot {
+  uint32_t codepoint;
+  int used;
+  int x, y, w, h; // in the atlas, y is the top row
+  int left;       // slot left edge relative to the pen
+  int top;        // slot top edge above the baseline
+  double advance;
+};
+
+CTFontRef textFont = NULL;
+double textAscent;
+double textDescent;
+unsigned char* atlasPixels = NULL;
+CGContextRef atlasContext = NULL;
+int atlasShelfX = 0;
+int atlasShelfY = 0;
+int atlasShelfH = 0;
+struct glyphSlot glyphCache[GLYPH_CACHE_SIZE];
+int glyphCount = 0;
+double textScale = 0;
+unsigned char* labelPixels = NULL;
+int labelCapacity = 0;
+
+FILE* eventStream = NULL;
+int traceFlag = 0;
+void flushMotion(FILE* out);
+
+int motionPending = 0;
+double pendingMouseX;
+double pendingMouseY;
+int wheelPending = 0;
+double pendingWheel = 0;
+
 void flushGraphics(){
   NSGraphicsContext* context = [NSGraphicsContext currentContext];
   //printf("flushing cocoa\n");
@@ -51,6 +102,235 @@ void setClip(double x, double y, double w, double h){
   NSRectClip(rect);
 }
 
+void resetGlyphCache(){
+  memset(atlasPixels, 0, ATLAS_SIZE * ATLAS_SIZE);
+  memset(glyphCache, 0, sizeof(glyphCache));
+  glyphCount = 0;
+  atlasShelfX = 0;
+  atlasShelfY = 0;
+  atlasShelfH = 0;
+}
+
+void initializeText(){
+  CGColorSpaceRef gray = CGColorSpaceCreateDeviceGray();
+  atlasPixels = malloc(ATLAS_SIZE * ATLAS_SIZE);
+  if(atlasPixels == NULL){
+    fprintf(stderr, "** VIDEO failed to allocate glyph atlas\n");
+    exit(-1);
+  }
+  atlasContext = CGBitmapContextCreate(
+    atlasPixels, ATLAS_SIZE, ATLAS_SIZE, 8, ATLAS_SIZE, gray, kCGImageAlphaNone
+  );
+  CGColorSpaceRelease(gray);
+  CGContextSetGrayFillColor(atlasContext, 1, 1);
+}
+
+// rebuild the font and start a fresh atlas when the window's backing scale
+// changes, e.g. moved to a retina display
+void checkTextScale(){
+  double scale = mainWindow ? [mainWindow backingScaleFactor] : 1;
+  if(scale == textScale) return;
+  textScale = scale;
+  if(textFont) CFRelease(textFont);
+  textFont = CTFontCreateWithName(CFSTR(TEXT_FONT), TEXT_POINTS * scale, NULL);
+  textAscent = CTFontGetAscent(textFont);
+  textDescent = CTFontGetDescent(textFont);
+  resetGlyphCache();
+}
+
+// scratch memory for label masks, grown as needed and never shrunk
+unsigned char* labelScratch(int bytes){
+  unsigned char* grown;
+  if(bytes <= labelCapacity) return labelPixels;
+  grown = realloc(labelPixels, bytes);
+  if(grown == NULL) return NULL;
+  labelPixels = grown;
+  labelCapacity = bytes;
+  return labelPixels;
+}
+
+// find room on the current shelf or start a new one. 0 if the atlas is full
+int allocateAtlas(int w, int h, int* x, int* y){
+  if(w > ATLAS_SIZE || h > ATLAS_SIZE) return 0;
+  if(atlasShelfX + w > ATLAS_SIZE){
+    atlasShelfY += atlasShelfH;
+    atlasShelfX = 0;
+    atlasShelfH = 0;
+  }
+  if(atlasShelfY + h > ATLAS_SIZE) return 0;
+  *x = atlasShelfX;
+  *y = atlasShelfY;
+  atlasShelfX += w;
+  if(h > atlasShelfH) atlasShelfH = h;
+  return 1;
+}
+
+void rasterizeGlyph(struct glyphSlot* slot, uint32_t cp){
+  UniChar units[2];
+  CGGlyph glyphs[2];
+  CGRect box;
+  CGSize advance;
+  CGPoint pen;
+  int n = 1;
+
+  if(cp >= 0x10000){
+    units[0] = 0xd800 + ((cp - 0x10000) >> 10);
+    units[1] = 0xdc00 + ((cp - 0x10000) & 0x3ff);
+    n = 2;
+  }
+  else{
+    units[0] = cp;
+  }
+  if(!CTFontGetGlyphsForCharacters(textFont, units, glyphs, n)){
+    units[0] = '?';
+    CTFontGetGlyphsForCharacters(textFont, units, glyphs, 1);
+  }
+  CTFontGetBoundingRectsForGlyphs(textFont, kCTFontOrientationDefault, glyphs, &box, 1);
+  CTFontGetAdvancesForGlyphs(textFont, kCTFontOrientationDefault, glyphs, &advance, 1);
+
+  slot->codepoint = cp;
+  slot->used = 1;
+  slot->advance = advance.width;
+  slot->w = ceil(box.size.width) + 2;
+  slot->h = ceil(box.size.height) + 2;
+  slot->left = floor(box.origin.x) - 1;
+  slot->top = floor(box.origin.y) - 1 + slot->h;
+  if(box.size.width == 0 || !allocateAtlas(slot->w, slot->h, &slot->x, &slot->y)){
+    slot->w = 0; // blank, or no room. drawn as nothing until the next reset
+    slot->h = 0;
+    return;
+  }
+  // the bitmap context has y up, row 0 of the atlas memory is at the top
+  pen.x = slot->x - slot->left;
+  pen.y = ATLAS_SIZE - slot->y - slot->top;
+  CTFontDrawGlyphs(textFont, glyphs, &pen, 1, atlasContext);
+}
+
+struct glyphSlot* lookupGlyph(uint32_t cp){
+  unsigned i = (cp * 2654435761u) & (GLYPH_CACHE_SIZE - 1);
+  while(glyphCache[i].used){
+    if(glyphCache[i].codepoint == cp) return &glyphCache[i];
+    i = (i + 1) & (GLYPH_CACHE_SIZE - 1);
+  }
+  if(glyphCount >= GLYPH_CACHE_SIZE / 2 || atlasShelfY + TEXT_POINTS * 2 * textScale > ATLAS_SIZE){
+    resetGlyphCache();
+    return lookupGlyph(cp);
+  }
+  glyphCount++;
+  rasterizeGlyph(&glyphCache[i], cp);
+  return &glyphCache[i];
+}
+
+// next code point of a utf-8 string, U+FFFD for junk
+uint32_t nextCodepoint(const unsigned char** p){
+  const unsigned char* s = *p;
+  uint32_t cp;
+  int extra;
+  int i;
+  if(s[0] < 0x80){ *p = s + 1; return s[0]; }
+  else if((s[0] & 0xe0) == 0xc0){ cp = s[0] & 0x1f; extra = 1; }
+  else if((s[0] & 0xf0) == 0xe0){ cp = s[0] & 0x0f; extra = 2; }
+  else if((s[0] & 0xf8) == 0xf0){ cp = s[0] & 0x07; extra = 3; }
+  else { *p = s + 1; return 0xfffd; }
+  for(i=1; i<=extra; i++){
+    if((s[i] & 0xc0) != 0x80){ *p = s + i; return 0xfffd; }
+    cp = cp << 6 | (s[i] & 0x3f);
+  }
+  *p = s + extra + 1;
+  return cp > 0x10ffff ? 0xfffd : cp;
+}
+
+// width in pixels from cached advances, no layout
+double measureText(const char* text){
+  const unsigned char* p = (const unsigned char*)text;
+  double width = 0;
+  checkTextScale();
+  while(*p) width += lookupGlyph(nextCodepoint(&p))->advance;
+  return width;
+}
+
+// x y is the top left corner of the text
+void paintText(double x, double y, int r, int g, int b, const char* text){
+  NSSize size = [[mainWindow contentView] frame].size;
+  CGContextRef port = [[NSGraphicsContext currentContext] graphicsPort];
+  CGColorSpaceRef gray;
+  CGDataProviderRef provider;
+  CGImageRef mask;
+  CGRect rect;
+  unsigned char* pixels;
+  const unsigned char* p;
+  struct glyphSlot* slot;
+  double pen = 0;
+  int width = ceil(measureText(text)) + 2;
+  int height = ceil(textAscent + textDescent) + 2;
+  int baseline = ceil(textAscent) + 1;
+  int stride;
+  int dx, dy;
+  int row, col;
+  unsigned char* src;
+  unsigned char* dst;
+
+  if(width <= 2) return;
+  if(width > LABEL_MAX_WIDTH) width = LABEL_MAX_WIDTH;
+  stride = (width + 15) & ~15;
+  pixels = labelScratch(stride * height);
+  if(pixels == NULL){
+    fprintf(stderr, "** VIDEO failed to allocate label bitmap\n");
+    return;
+  }
+  memset(pixels, 0, stride * height);
+
+  // copy glyph rows out of the atlas, max so overlapping edges stay solid
+  p = (const unsigned char*)text;
+  while(*p){
+    slot = lookupGlyph(nextCodepoint(&p));
+    dx = (int)floor(pen + 0.5) + 1 + slot->left;
+    dy = baseline - slot->top;
+    for(row=0; row<slot->h; row++){
+      if(dy + row < 0 || dy + row >= height) continue;
+      src = atlasPixels + (slot->y + row) * ATLAS_SIZE + slot->x;
+      dst = pixels + (dy + row) * stride;
+      for(col=0; col<slot->w; col++){
+        if(dx + col < 0 || dx + col >= width) continue;
+        if(src[col] > dst[dx + col]) dst[dx + col] = src[col];
+      }
+    }
+    pen += slot->advance;
+  }
+
+  // the mask reads the scratch memory directly, it's done with after the fill
+  gray = CGColorSpaceCreateDeviceGray();
+  provider = CGDataProviderCreateWithData(NULL, pixels, stride * height, NULL);
+  mask = CGImageCreate(width, height, 8, 8, stride, gray, kCGImageAlphaNone,
+    provider, NULL, false, kCGRenderingIntentDefault);
+  CGDataProviderRelease(provider);
+  CGColorSpaceRelease(gray);
+  if(mask == NULL){
+    fprintf(stderr, "** VIDEO failed to create label mask\n");
+    return;
+  }
+  rect = CGRectMake(x - 1 / textScale, size.height - y - height / textScale,
+    width / textScale, height / textScale);
+  CGContextSaveGState(port);
+  CGContextClipToMask(port, rect, mask);
+  CGContextSetRGBFillColor(port, r/255.0, g/255.0, b/255.0, 1);
+  CGContextFillRect(port, rect);
+  CGContextRestoreGState(port);
+  CGImageRelease(mask);
+}
+
+// skip the command and n numbers, return the rest of the line
+char* textArgument(char* line, int n){
+  int i;
+  while(*line && *line != ' ') line++;
+  for(i=0; i<n; i++){
+    while(*line == ' ') line++;
+    while(*line && *line != ' ') line++;
+  }
+  if(*line == ' ') line++;
+  return line;
+}
+
 void executePaintCommand(){
   char command[32];
   int base;
@@ -102,6 +382,42 @@ void executePaintCommand(){
     }
     else{ setClip(fargs[0], fargs[1], fargs[2], fargs[3]); }
   }
+  else if(strcmp(command, "label")==0){
+    results = sscanf((char*)paintBuffer+base, "%lf %lf", &fargs[0], &fargs[1]);
+    if(results < 2){
+      fprintf(stderr, "** VIDEO invalid label command\n");
+    }
+    else{
+      paintText(fargs[0], fargs[1], 0, 0, 0, textArgument((char*)paintBuffer, 2));
+    }
+  }
+  else if(strcmp(command, "text")==0){
+    results = sscanf(
+      (char*)paintBuffer+base, "%lf %lf %d %d %d",
+      &fargs[0], &fargs[1], &args[2], &args[3], &args[4]
+    );
+    if(results < 5){
+      fprintf(stderr, "** VIDEO invalid text command\n");
+    }
+    else{
+      paintText(fargs[0], fargs[1], args[2], args[3], args[4],
+        textArgument((char*)paintBuffer, 5));
+    }
+  }
+  else if(strcmp(command, "text-query")==0){
+    results = sscanf((char*)paintBuffer+base, "%d", &args[0]);
+    if(results < 1){
+      fprintf(stderr, "** VIDEO invalid text-query command\n");
+    }
+    else{
+      flushMotion(eventStream);
+      checkTextScale();
+      fprintf(eventStream, "text-metrics %d %.2f %.2f %.2f\n", args[0],
+        measureText(textArgument((char*)paintBuffer, 1)) / textScale,
+        textAscent / textScale, textDescent / textScale);
+      fflush(eventStream);
+    }
+  }
   else if(strcmp(command, "flush")==0){
     flushGraphics();
   }
@@ -186,6 +502,66 @@ void initializePaintBuffer(){
 }
 
 
+void putBinaryRecord(FILE* out, char kind, int32_t a, int32_t b){
+  unsigned char rec[RECORD_SIZE];
+  rec[0] = RECORD_MARK;
+  rec[1] = kind;
+  rec[2] = (a >> 24) & 0xff;
+  rec[3] = (a >> 16) & 0xff;
+  rec[4] = (a >> 8) & 0xff;
+  rec[5] = a & 0xff;
+  rec[6] = (b >> 24) & 0xff;
+  rec[7] = (b >> 16) & 0xff;
+  rec[8] = (b >> 8) & 0xff;
+  rec[9] = b & 0xff;
+  fwrite(rec, 1, RECORD_SIZE, out);
+}
+
+// positions in 1/256 pixel, wheel deltas in 1/65536 line
+void flushMotion(FILE* out){
+  if(motionPending){
+    putBinaryRecord(out, 'm',
+      (int32_t)(pendingMouseX * 256),
+      (int32_t)(pendingMouseY * 256)
+    );
+    motionPending = 0;
+  }
+  if(wheelPending){
+    putBinaryRecord(out, 'w', (int32_t)(pendingWheel * 65536), 0);
+    pendingWheel = 0;
+    wheelPending = 0;
+  }
+  fflush(out);
+}
+
+void queueMouse(double x, double y){
+  pendingMouseX = x;
+  pendingMouseY = y;
+  motionPending = 1;
+}
+
+void queueWheel(double dy){
+  pendingWheel += dy;
+  wheelPending = 1;
+}
+
+// with EPICHORD_TRACE set, key and button events are preceded by the host
+// time they were written at, for latency tracing
+void putTraceStamp(FILE* out){
+  uint64_t now;
+  if(traceFlag){
+    now = mach_absolute_time();
+    putBinaryRecord(out, 't', (int32_t)(now >> 32), (int32_t)(now & 0xffffffff));
+  }
+}
+
+void putButton(FILE* out, char kind, int button){
+  flushMotion(out);
+  putTraceStamp(out);
+  putBinaryRecord(out, kind, button, 0);
+  fflush(out);
+}
+
 /*
 void showGraphics(){
   CGContextRef context = [[NSGraphicsContext currentContext] graphicsPort];
@@ -428,31 +804,31 @@ void spawnCore(NSFileHandle** paintIn, FILE** eventOut){
 }
 
 - (void)mouseDown:theEvent {
-  fprintf(self.eventOut, "click %d\n", 0);
+  putButton(self.eventOut, 'c', 0);
   //printf("mouse down cocoa\n");
 }
 
 - (void)mouseUp:theEvent {
-  fprintf(self.eventOut, "release %d\n", 0);
+  putButton(self.eventOut, 'r', 0);
   //printf("mouse up cocoa\n");
 }
 
 - (void)rightMouseDown:theEvent {
-  fprintf(self.eventOut, "click %d\n", 1);
+  putButton(self.eventOut, 'c', 1);
 }
 
 - (void)rightMouseUp:theEvent {
-  fprintf(self.eventOut, "release %d\n", 1);
+  putButton(self.eventOut, 'r', 1);
 }
 
 - (void)otherMouseDown:theEvent {
   int button = [theEvent buttonNumber];
-  fprintf(self.eventOut, "click %d\n", button);
+  putButton(self.eventOut, 'c', button);
 }
 
 - (void)otherMouseUp:theEvent {
   int button = [theEvent buttonNumber];
-  fprintf(self.eventOut, "release %d\n", button);
+  putButton(self.eventOut, 'r', button);
 }
 
 - (void)commonMouseMoved:theEvent {
@@ -461,7 +837,7 @@ void spawnCore(NSFileHandle** paintIn, FILE** eventOut){
   NSPoint p = [v convertPoint:[theEvent locationInWindow] fromView:nil];
   double mouseX = p.x;
   double mouseY = size.height - p.y;
-  fprintf(self.eventOut, "mouse %lf %lf\n", mouseX, mouseY);
+  queueMouse(mouseX, mouseY);
   //printf("mouse moved cocoa\n");
 }
 
@@ -486,7 +862,9 @@ void spawnCore(NSFileHandle** paintIn, FILE** eventOut){
   const char* name = keycodeToString(k);
   char c[16];
 
+  flushMotion(self.eventOut);
   if(![theEvent isARepeat]){
+    putTraceStamp(self.eventOut);
     if(name) fprintf(self.eventOut, "keydown %s\n", name);
     else     fprintf(self.eventOut, "keydown unknown cocoa %u\n", k);
   }
@@ -507,6 +885,8 @@ void spawnCore(NSFileHandle** paintIn, FILE** eventOut){
 - (void)keyUp:theEvent {
   CGKeyCode k = [theEvent keyCode];
   const char* name = keycodeToString(k);
+  flushMotion(self.eventOut);
+  putTraceStamp(self.eventOut);
   if(name) fprintf(self.eventOut, "keyup %s\n", name);
   else     fprintf(self.eventOut, "keyup unknown cocoa %u\n", k);
 }
@@ -515,6 +895,7 @@ void spawnCore(NSFileHandle** paintIn, FILE** eventOut){
   CGKeyCode k = [theEvent keyCode];
   const char* name = keycodeToString(k);
   int down = modifierDown(k, [theEvent modifierFlags]);
+  flushMotion(self.eventOut);
   if(name != NULL){
     if(down == 1) fprintf(self.eventOut, "keydown %s\n", name);
     if(down == 0) fprintf(self.eventOut, "keyup %s\n", name);
@@ -524,7 +905,7 @@ void spawnCore(NSFileHandle** paintIn, FILE** eventOut){
 
 - (void)scrollWheel:(NSEvent*)theEvent {
   double dy = theEvent.deltaY;
-  fprintf(self.eventOut, "wheel %lf\n", dy);
+  queueWheel(dy);
 }
 
 - (void)display {
@@ -548,6 +929,7 @@ void spawnCore(NSFileHandle** paintIn, FILE** eventOut){
 @implementation MyWindowDelegate
 
 - (BOOL)windowShouldClose:(id)sender {
+  flushMotion(self.eventOut);
   fprintf(self.eventOut, "quit\n");
   return NO;
 }
@@ -562,12 +944,13 @@ void spawnCore(NSFileHandle** paintIn, FILE** eventOut){
   NSPoint p = [v convertPoint:loc fromView:nil];
   double mouseX = p.x;
   double mouseY = size.height - p.y;
-  fprintf(self.eventOut, "mouse %lf %lf\n", mouseX, mouseY);
+  queueMouse(mouseX, mouseY);
 }
 
 - (void)windowDidEndLiveResize:(NSNotification*)notif {
   NSWindow* win = [notif object];
   NSSize size = [[win contentView] frame].size;
+  flushMotion(self.eventOut);
   fprintf(self.eventOut, "resize %d %d\n", (int)size.width, (int)size.height);
 
   //printf("resize cocoa\n");
@@ -589,6 +972,7 @@ void spawnCore(NSFileHandle** paintIn, FILE** eventOut){
 }
 
 - (NSApplicationTerminateReply)applicationShouldTerminate:sender {
+  flushMotion(self.eventOut);
   fprintf(self.eventOut, "quit\n");
   return NO;
 }
@@ -626,6 +1010,7 @@ void spawnCore(NSFileHandle** paintIn, FILE** eventOut){
 - (void)windowClosing:NSNotification;
 - (void)stdinReadable:NSNotification;
 - (void)windowUnminimize:NSNotification;
+- (void)motionFrame:NSTimer;
 //- (void)windowResized:NSNotification;
 
 - (void)registerWindowClosing;
@@ -659,10 +1044,15 @@ void dumpBytes(int n, const unsigned char* bytes){
   printf("window exposed\n");
 }
 
+- (void)motionFrame:(NSTimer*)timer {
+  if(motionPending || wheelPending) flushMotion(self.eventOut);
+}
+
 /*
 - (void)windowResized:notif {
   NSWindow* win = [notif object];
   NSSize size = [[win contentView] frame].size;
+  flushMotion(self.eventOut);
   fprintf(self.eventOut, "resize %d %d\n", (int)size.width, (int)size.height);
 
   //printf("resize cocoa\n");
@@ -730,6 +1120,8 @@ int main (int argc, const char * argv[])
   fprintf(stderr, "VIDEO Hello World\n");
 
   initializePaintBuffer();
+  initializeText();
+  traceFlag = getenv("EPICHORD_TRACE") != NULL;
 
   if(argc < 2){ // by default, spawn the core application
     spawnCore(&paintIn, &eventOut);
@@ -738,6 +1130,7 @@ int main (int argc, const char * argv[])
     //close(1);
     //dup(fileno(eventOut));
   }
+  eventStream = eventOut;
 
   [NSAutoreleasePool new];
   [NSApplication sharedApplication];
@@ -763,6 +1156,14 @@ int main (int argc, const char * argv[])
     object:paintIn ];
   [handler registerWindowClosing];
   [handler registerWindowUnminimize];
+  [[NSRunLoop currentRunLoop]
+    addTimer:[NSTimer
+      timerWithTimeInterval:MOTION_FRAME_S
+      target:handler
+      selector:@selector(motionFrame:)
+      userInfo:nil
+      repeats:YES ]
+    forMode:NSRunLoopCommonModes ];
   //[handler registerWindowResized];
   MyMenuHandler* menuHandler = [MyMenuHandler new];
 